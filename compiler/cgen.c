@@ -0,0 +1,536 @@
+// Copyright (C) 2017 Alexander Koch
+#include "cgen.h"
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <vm/vm.h>
+
+// Sizes of a boxed value and of an operand (a value with a conversion)
+#define CGEN_VALUE (CGEN_EXPR + 32)
+#define CGEN_BUF (CGEN_VALUE + 32)
+
+// Typed operations, that are kept as expressions
+// @operand Kind of the operands, @result Kind of the result
+typedef struct {
+    opcode_t op;
+    cgen_kind_t operand;
+    cgen_kind_t result;
+    const char* format;
+} cgen_op_t;
+
+static const cgen_op_t cgen_ops[] = {
+    // Addition, subtraction and multiplication wrap around like in the interpreter
+    {OP_IADD, CGEN_INT, CGEN_INT, "(int)((unsigned)%s + (unsigned)%s)"},
+    {OP_ISUB, CGEN_INT, CGEN_INT, "(int)((unsigned)%s - (unsigned)%s)"},
+    {OP_IMUL, CGEN_INT, CGEN_INT, "(int)((unsigned)%s * (unsigned)%s)"},
+    {OP_IDIV, CGEN_INT, CGEN_INT, "(%s / %s)"},
+    {OP_MOD, CGEN_INT, CGEN_INT, "(%s %% %s)"},
+    {OP_BITL, CGEN_INT, CGEN_INT, "(%s << %s)"},
+    {OP_BITR, CGEN_INT, CGEN_INT, "(%s >> %s)"},
+    {OP_BITAND, CGEN_INT, CGEN_INT, "(%s & %s)"},
+    {OP_BITOR, CGEN_INT, CGEN_INT, "(%s | %s)"},
+    {OP_BITXOR, CGEN_INT, CGEN_INT, "(%s ^ %s)"},
+    {OP_FADD, CGEN_NUM, CGEN_NUM, "(%s + %s)"},
+    {OP_FSUB, CGEN_NUM, CGEN_NUM, "(%s - %s)"},
+    {OP_FMUL, CGEN_NUM, CGEN_NUM, "(%s * %s)"},
+    {OP_FDIV, CGEN_NUM, CGEN_NUM, "(%s / %s)"},
+    {OP_BEQ, CGEN_BOOL, CGEN_BOOL, "(%s == %s)"},
+    {OP_BNE, CGEN_BOOL, CGEN_BOOL, "(%s != %s)"},
+    {OP_BAND, CGEN_BOOL, CGEN_BOOL, "(%s && %s)"},
+    {OP_BOR, CGEN_BOOL, CGEN_BOOL, "(%s || %s)"},
+    {OP_IEQ, CGEN_INT, CGEN_BOOL, "(%s == %s)"},
+    {OP_INE, CGEN_INT, CGEN_BOOL, "(%s != %s)"},
+    {OP_ILT, CGEN_INT, CGEN_BOOL, "(%s < %s)"},
+    {OP_IGT, CGEN_INT, CGEN_BOOL, "(%s > %s)"},
+    {OP_ILE, CGEN_INT, CGEN_BOOL, "(%s <= %s)"},
+    {OP_IGE, CGEN_INT, CGEN_BOOL, "(%s >= %s)"},
+    {OP_FEQ, CGEN_NUM, CGEN_BOOL, "(%s == %s)"},
+    {OP_FNE, CGEN_NUM, CGEN_BOOL, "(%s != %s)"},
+    {OP_FLT, CGEN_NUM, CGEN_BOOL, "(%s < %s)"},
+    {OP_FGT, CGEN_NUM, CGEN_BOOL, "(%s > %s)"},
+    {OP_FLE, CGEN_NUM, CGEN_BOOL, "(%s <= %s)"},
+    {OP_FGE, CGEN_NUM, CGEN_BOOL, "(%s >= %s)"},
+    {OP_BITNOT, CGEN_INT, CGEN_INT, "(~%s)"},
+    {OP_IMINUS, CGEN_INT, CGEN_INT, "(int)(0u - (unsigned)%s)"},
+    {OP_I2F, CGEN_INT, CGEN_NUM, "((double)%s)"},
+    {OP_FMINUS, CGEN_NUM, CGEN_NUM, "(-%s)"},
+    {OP_F2I, CGEN_NUM, CGEN_INT, "((int)%s)"},
+    {OP_NOT, CGEN_BOOL, CGEN_BOOL, "(!%s)"},
+    {OP_B2I, CGEN_BOOL, CGEN_INT, "((int)%s)"}
+};
+
+const cgen_op_t* cgen_op_find(opcode_t op) {
+    for(size_t i = 0; i < sizeof(cgen_ops) / sizeof(cgen_ops[0]); i++) {
+        if(cgen_ops[i].op == op) return &cgen_ops[i];
+    }
+    return 0;
+}
+
+// Writes an indented statement
+void cgen_line(cgen_t* c, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(c->fp, "    ");
+    vfprintf(c->fp, format, args);
+    fprintf(c->fp, "\n");
+    va_end(args);
+}
+
+// Boxed value of the entry @i
+void cgen_value(cgen_t* c, int i, char* buf) {
+    cgen_entry_t* e = &c->stack[i];
+    switch(e->kind) {
+        case CGEN_SLOT: snprintf(buf, CGEN_VALUE, "fp[%d]", i); break;
+        case CGEN_VAL: strcpy(buf, e->expr); break;
+        case CGEN_INT: snprintf(buf, CGEN_VALUE, "aot_int_val(%s)", e->expr); break;
+        case CGEN_NUM: snprintf(buf, CGEN_VALUE, "aot_num_val(%s)", e->expr); break;
+        case CGEN_BOOL: snprintf(buf, CGEN_VALUE, "BOOL_VAL(%s)", e->expr); break;
+    }
+}
+
+// Raw value of the entry @i as an int, double or bool
+void cgen_operand(cgen_t* c, int i, cgen_kind_t kind, char* buf) {
+    cgen_entry_t* e = &c->stack[i];
+    if(e->kind == kind) {
+        strcpy(buf, e->expr);
+        return;
+    }
+
+    char val[CGEN_VALUE];
+    cgen_value(c, i, val);
+    switch(kind) {
+        case CGEN_INT: snprintf(buf, CGEN_BUF, "aot_int(%s)", val); break;
+        case CGEN_NUM: snprintf(buf, CGEN_BUF, "aot_num(%s)", val); break;
+        case CGEN_BOOL: snprintf(buf, CGEN_BUF, "AS_BOOL(%s)", val); break;
+        default: strcpy(buf, val); break;
+    }
+}
+
+// Stores the entry @i in its slot.
+// Expressions below may still read the slot (their operands), they are stored first.
+void cgen_materialize(cgen_t* c, int i) {
+    cgen_entry_t* e = &c->stack[i];
+    if(e->kind == CGEN_SLOT) return;
+    for(int j = 0; j < i; j++) {
+        if(c->stack[j].reads) cgen_materialize(c, j);
+    }
+
+    char val[CGEN_BUF];
+    cgen_value(c, i, val);
+    cgen_line(c, "fp[%d] = %s;", i, val);
+    e->kind = CGEN_SLOT;
+    e->reads = false;
+}
+
+// Stores all entries, required before the stack is used and at jumps
+void cgen_flush(cgen_t* c) {
+    for(int i = 0; i < c->depth; i++) {
+        cgen_materialize(c, i);
+    }
+}
+
+// Stores the entries that read variables, before a variable is written
+void cgen_flush_reads(cgen_t* c) {
+    for(int i = 0; i < c->depth; i++) {
+        if(c->stack[i].reads) cgen_materialize(c, i);
+    }
+}
+
+void cgen_push(cgen_t* c, cgen_kind_t kind, bool reads, const char* format, ...) {
+    cgen_entry_t* e = &c->stack[c->depth++];
+    e->kind = kind;
+    e->reads = reads;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(e->expr, CGEN_EXPR, format, args);
+    va_end(args);
+}
+
+// The top @n entries are used as operands.
+// If the resulting expression would get too long, they are stored first.
+bool cgen_operands(cgen_t* c, int n) {
+    size_t len = 0;
+    bool reads = false;
+    for(int i = c->depth - n; i < c->depth; i++) {
+        len += strlen(c->stack[i].expr) + 32;
+        reads |= c->stack[i].reads || c->stack[i].kind == CGEN_SLOT;
+    }
+
+    if(len >= CGEN_EXPR - 64) {
+        for(int i = c->depth - n; i < c->depth; i++) {
+            cgen_materialize(c, i);
+        }
+    }
+    return reads;
+}
+
+// Loads are kept as expressions, a stack entry is stored first
+void cgen_load(cgen_t* c, int slot) {
+    if(slot >= 0 && slot < c->depth) {
+        cgen_materialize(c, slot);
+    }
+    cgen_push(c, CGEN_VAL, true, "fp[%d]", slot);
+}
+
+// Pops the value of a store, the entries reading variables are stored first
+void cgen_store_value(cgen_t* c, char* buf, bool* raw) {
+    int i = --c->depth;
+    cgen_entry_t* e = &c->stack[i];
+    cgen_flush_reads(c);
+    if(e->kind == CGEN_SLOT) {
+        snprintf(buf, CGEN_BUF, "fp[%d]", i);
+    } else {
+        cgen_value(c, i, buf);
+    }
+
+    // Ints, doubles and bools are not counted
+    *raw = e->kind == CGEN_INT || e->kind == CGEN_NUM || e->kind == CGEN_BOOL;
+}
+
+void cgen_store(cgen_t* c, const char* slot) {
+    char val[CGEN_BUF];
+    bool raw = false;
+    cgen_store_value(c, val, &raw);
+    if(raw) {
+        cgen_line(c, "RELEASE_VAL(%s);", slot);
+        cgen_line(c, "%s = %s;", slot, val);
+    } else {
+        cgen_line(c, "vm_store(&%s, %s);", slot, val);
+    }
+}
+
+// Constant, numbers are written as literals
+void cgen_const(cgen_t* c, int index) {
+    val_t val = c->bytecode->consts[index];
+    if(IS_OBJ(val)) {
+        cgen_push(c, CGEN_VAL, false, "k[%d]", index);
+    } else if(IS_BOOL(val)) {
+        cgen_push(c, CGEN_BOOL, false, AS_BOOL(val) ? "true" : "false");
+    } else if(IS_INT32(val)) {
+        cgen_push(c, CGEN_INT, false, "(%d)", AS_INT32(val));
+    } else if(IS_NUM(val) && isfinite(AS_NUM(val))) {
+        // Round trip of the double, the literal needs a point or exponent
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.17g", AS_NUM(val));
+        if(!strpbrk(buf, ".e")) strcat(buf, ".0");
+        cgen_push(c, CGEN_NUM, false, "(%s)", buf);
+    } else {
+        cgen_push(c, CGEN_VAL, false, "(val_t)0x%llxULL", (unsigned long long)val);
+    }
+}
+
+// String constant as a C literal
+void cgen_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for(; *str; str++) {
+        unsigned char ch = *str;
+        if(ch == '"' || ch == '\\') {
+            fprintf(fp, "\\%c", ch);
+        } else if(ch < 32 || ch >= 127) {
+            fprintf(fp, "\\%03o", ch);
+        } else {
+            fputc(ch, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Translates the instruction at @pc, returns false if it is not supported
+bool cgen_instr(cgen_t* c, int pc) {
+    code_t* code = &c->bytecode->code[pc];
+    char a[CGEN_BUF];
+    char b[CGEN_BUF];
+    int h = c->depth;
+
+    const cgen_op_t* op = cgen_op_find(code->op);
+    if(op) {
+        if(code->op == OP_BITNOT || code->op == OP_IMINUS || code->op == OP_I2F
+            || code->op == OP_FMINUS || code->op == OP_F2I || code->op == OP_NOT || code->op == OP_B2I) {
+            bool reads = cgen_operands(c, 1);
+            cgen_operand(c, h-1, op->operand, a);
+            c->depth--;
+            cgen_push(c, op->result, reads, op->format, a);
+        } else {
+            bool reads = cgen_operands(c, 2);
+            cgen_operand(c, h-2, op->operand, a);
+            cgen_operand(c, h-1, op->operand, b);
+            c->depth -= 2;
+            cgen_push(c, op->result, reads, op->format, a, b);
+        }
+        return true;
+    }
+
+    switch(code->op) {
+        case OP_PUSH: cgen_const(c, code->a); break;
+        case OP_POP: c->depth--; break;
+        case OP_LOAD: cgen_load(c, code->a); break;
+        case OP_GLOAD: {
+            // The top-level frame is the global scope
+            if(c->entry == 0) {
+                cgen_load(c, code->a);
+            } else {
+                cgen_push(c, CGEN_VAL, true, "vm->stack[%d]", code->a);
+            }
+            break;
+        }
+        case OP_STORE: {
+            snprintf(b, CGEN_BUF, "fp[%d]", code->a);
+            cgen_store(c, b);
+            break;
+        }
+        case OP_GSTORE: {
+            snprintf(b, CGEN_BUF, c->entry == 0 ? "fp[%d]" : "vm->stack[%d]", code->a);
+            cgen_store(c, b);
+            break;
+        }
+        case OP_LDARG0: cgen_push(c, CGEN_VAL, true, "fp[-aot_int(fp[-3])-4]"); break;
+        case OP_SETARG0: cgen_store(c, "fp[-aot_int(fp[-3])-4]"); break;
+        case OP_UPVAL: cgen_push(c, CGEN_VAL, true, "aot_frame(vm, fp, %d)[%d]", code->a, code->b); break;
+        case OP_UPSTORE: {
+            snprintf(b, CGEN_BUF, "aot_frame(vm, fp, %d)[%d]", code->a, code->b);
+            cgen_store(c, b);
+            break;
+        }
+        case OP_GETSUB: {
+            bool reads = cgen_operands(c, 2);
+            cgen_operand(c, h-2, CGEN_VAL, a);
+            cgen_operand(c, h-1, CGEN_INT, b);
+            c->depth -= 2;
+            cgen_push(c, CGEN_VAL, reads, "aot_getsub(%s, %s)", a, b);
+            break;
+        }
+        case OP_LEN: {
+            bool reads = cgen_operands(c, 1);
+            cgen_operand(c, h-1, CGEN_VAL, a);
+            c->depth--;
+            cgen_push(c, CGEN_INT, reads, "aot_len(%s)", a);
+            break;
+        }
+        case OP_GETFIELD: {
+            bool reads = cgen_operands(c, 1);
+            cgen_operand(c, h-1, CGEN_VAL, a);
+            c->depth--;
+            cgen_push(c, CGEN_VAL, reads, "AS_CLASS(%s)->fields[%d]", a, code->a);
+            break;
+        }
+        case OP_JMPF: {
+            cgen_operand(c, h-1, CGEN_BOOL, a);
+            c->depth--;
+            cgen_flush(c);
+            cgen_line(c, "if(!%s) goto L%d;", a, code->a);
+            break;
+        }
+        case OP_LDLIB: break;
+        default: {
+            // The remaining instructions work on the stack
+            cgen_flush(c);
+            switch(code->op) {
+                case OP_HLT: cgen_line(c, c->entry == 0 ? "return;" : "aot_halt(vm);"); break;
+                case OP_JMP: cgen_line(c, "goto L%d;", code->a); break;
+                case OP_RET: cgen_line(c, "aot_ret(vm, fp, fp + %d);", h); cgen_line(c, "return;"); break;
+                case OP_RETVIRTUAL: cgen_line(c, "aot_retvirtual(vm, fp, fp + %d);", h); cgen_line(c, "return;"); break;
+                case OP_SYSCALL: cgen_line(c, "aot_syscall(vm, fp, fp + %d, %d, %d);", h, code->a, pc); break;
+                case OP_INVOKE: {
+                    cgen_line(c, "fn_%d(vm, aot_invoke(vm, fp, fp + %d, %d, %d, %d));",
+                        code->a, h, code->b, c->size[code->a], pc);
+                    break;
+                }
+                case OP_RESERVE: {
+                    // New variables are cleared, freed ones lose their value
+                    for(int i = 0; i < code->a; i++) {
+                        cgen_line(c, "fp[%d] = NULL_VAL;", h + i);
+                    }
+                    for(int i = code->a; i < 0; i++) {
+                        cgen_line(c, "RELEASE_VAL(fp[%d]);", h + i);
+                    }
+                    cgen_line(c, "vm->lp = fp - vm->stack + %d;", h + code->a);
+                    break;
+                }
+                case OP_ARR: cgen_line(c, "aot_arr(vm, fp + %d, %d);", h, code->a); break;
+                case OP_STR: cgen_line(c, "aot_str(vm, fp + %d, %d);", h, code->a); break;
+                case OP_TOSTR: cgen_line(c, "aot_tostr(vm, fp + %d);", h); break;
+                case OP_APPEND: cgen_line(c, "aot_append(vm, fp + %d);", h); break;
+                case OP_SETSUB: cgen_line(c, "aot_setsub(vm, fp + %d);", h); break;
+                case OP_MSETSUB: cgen_line(c, "aot_msetsub(vm, fp + %d);", h); break;
+                case OP_CONS: cgen_line(c, "aot_cons(vm, fp + %d);", h); break;
+                case OP_MCONS: cgen_line(c, "aot_mcons(vm, fp + %d);", h); break;
+                case OP_CLASS: cgen_line(c, "aot_class(vm, fp + %d, %d);", h, code->a); break;
+                case OP_SETFIELD: cgen_line(c, "aot_setfield(vm, fp + %d, %d);", h, code->a); break;
+                default: {
+                    printf("Instruction '%s' can not be translated to C\n", op2str(code->op));
+                    return false;
+                }
+            }
+
+            // Results are stored in their slots
+            c->depth = h + vm_stack_effect(code);
+            for(int i = 0; i < c->depth; i++) {
+                c->stack[i].kind = CGEN_SLOT;
+                c->stack[i].reads = false;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+// Translates the instructions of the function @entry
+bool cgen_function(cgen_t* c, int entry) {
+    bytecode_t* bytecode = c->bytecode;
+    c->entry = entry;
+    if(entry == 0) {
+        fprintf(c->fp, "static void fn_main(vm_t* vm) {\n");
+        fprintf(c->fp, "    val_t* fp = vm->stack;\n");
+    } else {
+        fprintf(c->fp, "static void fn_%d(vm_t* vm, val_t* fp) {\n", entry);
+    }
+
+    bool known = false;
+    for(size_t pc = 0; pc < bytecode->len; pc++) {
+        if(c->owner[pc] != entry) continue;
+
+        // New basic block, the stack is stored
+        if(c->leader[pc] || !known) {
+            if(known) cgen_flush(c);
+            c->depth = c->height[pc];
+            for(int i = 0; i < c->depth; i++) {
+                c->stack[i].kind = CGEN_SLOT;
+                c->stack[i].reads = false;
+            }
+            known = true;
+        }
+        if(c->leader[pc]) {
+            fprintf(c->fp, "L%d:;\n", (int)pc);
+        }
+
+        if(!cgen_instr(c, pc)) return false;
+
+        opcode_t op = bytecode->code[pc].op;
+        if(op == OP_JMP || op == OP_RET || op == OP_RETVIRTUAL || op == OP_HLT) {
+            known = false;
+        }
+    }
+
+    fprintf(c->fp, "}\n\n");
+    return true;
+}
+
+// Live variables at the calls of the generated code (see vm_stack_maps)
+bool cgen_stack_maps(cgen_t* c) {
+    vm_stackmap_t maps;
+    if(!vm_stack_maps(c->bytecode, &maps)) return false;
+
+    FILE* fp = c->fp;
+    size_t len = c->bytecode->len;
+    int words = 0;
+    fprintf(fp, "static int live_index[%d] = {", (int)len);
+    for(size_t i = 0; i < len; i++) {
+        fprintf(fp, "%s%d,", (i % 16 == 0) ? "\n    " : " ", maps.index[i]);
+        if(maps.index[i] >= 0) words = maps.index[i] + maps.words;
+    }
+    fprintf(fp, "\n};\n");
+    fprintf(fp, "static uint64_t live_bits[%d] = {", words > 0 ? words : 1);
+    for(int i = 0; i < words; i++) {
+        fprintf(fp, "%s0x%llxull,", (i % 4 == 0) ? "\n    " : " ", (unsigned long long)maps.bits[i]);
+    }
+    fprintf(fp, "\n};\n\n");
+
+    c->words = maps.words;
+    free(maps.index);
+    free(maps.bits);
+    return true;
+}
+
+bool cgen_translate(cgen_t* c) {
+    bytecode_t* bytecode = c->bytecode;
+    size_t len = bytecode->len;
+    if(!vm_stack_heights(bytecode, c->height)) {
+        printf("The stack heights of the code are unknown, it can not be translated to C\n");
+        return false;
+    }
+
+    // Functions are the invoked addresses, the top-level code is the entry 0
+    for(size_t i = 0; i < len; i++) {
+        code_t* code = &bytecode->code[i];
+        int* addr = bytecode_target(code);
+        if(addr && code->op != OP_INVOKE) c->leader[*addr] = true;
+        if(code->op == OP_INVOKE && c->size[code->a] == -1) {
+            c->size[code->a] = vm_frame_size(bytecode, c->height, c->owner, code->a);
+        }
+    }
+    int size = vm_frame_size(bytecode, c->height, c->owner, 0);
+
+    // Constants and prototypes
+    FILE* fp = c->fp;
+    fprintf(fp, "static val_t k[%d];\n\n", bytecode->num_consts > 0 ? (int)bytecode->num_consts : 1);
+    bool maps = cgen_stack_maps(c);
+    for(size_t i = 0; i < len; i++) {
+        if(c->size[i] != -1) {
+            fprintf(fp, "static void fn_%d(vm_t* vm, val_t* fp);\n", (int)i);
+        }
+    }
+    fprintf(fp, "\n");
+
+    for(size_t i = 0; i < len; i++) {
+        if(c->size[i] != -1 && !cgen_function(c, i)) return false;
+    }
+    if(!cgen_function(c, 0)) return false;
+
+    // Constant objects are pinned like in the interpreter (see code_push)
+    fprintf(fp, "int main(int argc, char** argv) {\n");
+    fprintf(fp, "    static vm_t vm;\n");
+    for(size_t i = 0; i < bytecode->num_consts; i++) {
+        val_t val = bytecode->consts[i];
+        if(!IS_STRING(val)) continue;
+        fprintf(fp, "    k[%d] = STRING_CONST_VAL(", (int)i);
+        cgen_string(fp, AS_STRING(val));
+        fprintf(fp, ");\n");
+        fprintf(fp, "    RETAIN_VAL(k[%d]);\n", (int)i);
+    }
+    if(maps) {
+        fprintf(fp, "    vm.maps = (vm_stackmap_t){live_index, live_bits, %d};\n", c->words);
+    }
+    fprintf(fp, "    aot_run(&vm, fn_main, %d, argc, argv);\n", size);
+    fprintf(fp, "    for(int i = 0; i < %d; i++) {\n", (int)bytecode->num_consts);
+    fprintf(fp, "        val_free(k[i]);\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    return 0;\n");
+    fprintf(fp, "}\n");
+    return true;
+}
+
+bool cgen_emit(bytecode_t* bytecode, const char* filename, const char* source) {
+    FILE* fp = fopen(filename, "w");
+    if(!fp) {
+        printf("Could not write file '%s'\n", filename);
+        return false;
+    }
+
+    size_t len = bytecode->len;
+    cgen_t c = {0};
+    c.fp = fp;
+    c.bytecode = bytecode;
+    c.height = malloc(sizeof(int) * len);
+    c.owner = malloc(sizeof(int) * len);
+    c.size = malloc(sizeof(int) * len);
+    c.leader = calloc(len, sizeof(bool));
+    c.stack = malloc(sizeof(cgen_entry_t) * STACK_SIZE);
+    for(size_t i = 0; i < len; i++) {
+        c.owner[i] = -1;
+        c.size[i] = -1;
+    }
+
+    fprintf(fp, "// Generated by golem --emit-c from '%s'\n", source);
+    fprintf(fp, "#include <vm/aot.h>\n\n");
+    bool result = cgen_translate(&c);
+
+    fclose(fp);
+    if(!result) remove(filename);
+    free(c.height);
+    free(c.owner);
+    free(c.size);
+    free(c.leader);
+    free(c.stack);
+    return result;
+}
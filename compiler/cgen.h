@@ -0,0 +1,68 @@
+/**
+ * cgen.h
+ * Copyright (C) 2017 Alexander Koch
+ * C code generator
+ *
+ * Translates the typed bytecode of the compiler into a C translation unit,
+ * that runs on the runtime of the vm (see aot.h).
+ * Every function becomes a C function, jumps become gotos.
+ * The stack height of every instruction is known statically, so operand stack entries
+ * are kept in C expressions. The typed instructions (iadd, fadd, ilt, ...) work on raw
+ * ints, doubles and bools, values are only boxed, when they are stored in the stack.
+ *
+ * Build the program with:
+ *   make lib
+ *   gcc -O2 -std=c99 -I<golem> <file>.c <golem>/libgolem.a -lm -pthread
+ */
+
+#ifndef cgen_h
+#define cgen_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <vm/bytecode.h>
+
+// Length of a kept expression, longer expressions are stored first
+#define CGEN_EXPR 192
+
+typedef enum {
+    CGEN_SLOT,
+    CGEN_VAL,
+    CGEN_INT,
+    CGEN_NUM,
+    CGEN_BOOL
+} cgen_kind_t;
+
+// Operand stack entry
+// @kind Stored in its slot or the type of the expression
+// @reads The expression reads variables or objects
+typedef struct {
+    cgen_kind_t kind;
+    bool reads;
+    char expr[CGEN_EXPR];
+} cgen_entry_t;
+
+// @height Stack height of every instruction, @owner Function of every instruction
+// @leader Jump targets, that get a label
+// @size Stack size of every function, @words Width of the stack maps (see cgen_stack_maps)
+typedef struct {
+    FILE* fp;
+    bytecode_t* bytecode;
+    int* height;
+    int* owner;
+    int* size;
+    int words;
+    bool* leader;
+    int entry;
+    cgen_entry_t* stack;
+    int depth;
+} cgen_t;
+
+/**
+ * Writes the C translation of the bytecode to the file @filename.
+ * Has to be called before the code is modified for execution (fusion, register code).
+ * Returns false, if the code could not be translated.
+ */
+bool cgen_emit(bytecode_t* bytecode, const char* filename, const char* source);
+
+#endif
@@ -225,7 +225,14 @@ datatype_t* eval_block(compiler_t* compiler, list_t* block) {
     list_iterator_reset(iter, block);
     while(!list_iterator_end(iter)) {
         // Evaluate each list item.
+        size_t start = vector_size(compiler->buffer);
         ret = compiler_eval(compiler, list_iterator_next(iter));
+
+        // Discard the value of an expression statement,
+        // so that no operands are left on the stack.
+        if(vector_size(compiler->buffer) > start && ret->type != DATA_NULL && ret->type != DATA_VOID) {
+            emit_pop(compiler->buffer);
+        }
     }
     list_iterator_free(iter);
 
@@ -450,6 +457,41 @@ datatype_t* eval_bool(compiler_t* compiler, ast_t* node) {
     return context_get(compiler->context, "bool");
 }
 
+/**
+ * eval_self_add:
+ * Compiles the assignment x := x.add(value) of a mutable variable.
+ * The value is evaluated before the variable is loaded, so that
+ * the array can be extended in place (mcons), if the variable is the only owner.
+ * Returns false, if the assignment does not match the pattern.
+ */
+bool eval_self_add(compiler_t* compiler, ast_t* node, symbol_t* symbol) {
+    ast_t* lhs = node->binary.left;
+    ast_t* rhs = node->binary.right;
+    if(rhs->class != AST_CALL || list_size(rhs->call.args) != 1) return false;
+
+    ast_t* call = rhs->call.callee;
+    if(call->class != AST_SUBSCRIPT) return false;
+
+    ast_t* expr = call->subscript.expr;
+    ast_t* key = call->subscript.key;
+    if(expr->class != AST_IDENT || key->class != AST_IDENT) return false;
+    if(strcmp(expr->ident, lhs->ident) || strcmp(key->ident, "add")) return false;
+
+    datatype_t* dt = symbol->node->vardecl.type;
+    if(dt->type != DATA_ARRAY) return false;
+
+    datatype_t* subelem = compiler_eval(compiler, list_get(rhs->call.args, 0));
+    if(!datatype_match(dt->subtype, subelem)) {
+        compiler_throw(compiler, node, "Argument has the wrong type");
+        return true;
+    }
+
+    compiler_eval(compiler, expr);
+    emit_op(compiler->buffer, OP_MCONS);
+    symbol_replace(compiler, symbol);
+    return true;
+}
+
 // Eval.binary(node)
 // This function evaluates a binary node.
 // A binary node consists of two seperate nodes
@@ -573,6 +615,11 @@ datatype_t* eval_binary(compiler_t* compiler, ast_t* node) {
                         return context_null(compiler->context);
                     }
 
+                    // Append in place: x := x.add(value)
+                    if(!symbol->owner && eval_self_add(compiler, node, symbol)) {
+                        return context_null(compiler->context);
+                    }
+
                     if(symbol->owner) {
                         // ldarg0
                         // <...>
@@ -649,10 +696,17 @@ datatype_t* eval_binary(compiler_t* compiler, ast_t* node) {
                             }
 
                             // If we found a subscript, it has to be an array
-                            // Evaluate the rhs and lhs
+                            // Evaluate the rhs and lhs.
+                            // A variable is loaded after the key (msetsub), so that
+                            // it is still the owner, when it is modified in place.
                             datatype_t* rhsType = compiler_eval(compiler, rhs);
-                            datatype_t* lhsType = compiler_eval(compiler, expr);
-
+                            datatype_t* lhsType = 0;
+                            if(symbol->owner) {
+                                lhsType = compiler_eval(compiler, expr);
+                            } else {
+                                compiler_eval(compiler, key);
+                                lhsType = compiler_eval(compiler, expr);
+                            }
 
                             // arrType = datatype_new(lhsType.type & ~DATA_ARRAY);
                             datatype_t* arrType = lhsType->subtype;
@@ -666,9 +720,12 @@ datatype_t* eval_binary(compiler_t* compiler, ast_t* node) {
                             // lhs -> string / array otherwise error
                             // lhs -> vardecl / namespace varaible declaration
 
-                            compiler_eval(compiler, key);
-                            emit_op(compiler->buffer, OP_SETSUB);
-                            //emit_store(compiler->buffer, symbol->address, symbol->global);
+                            if(symbol->owner) {
+                                compiler_eval(compiler, key);
+                                emit_op(compiler->buffer, OP_SETSUB);
+                            } else {
+                                emit_op(compiler->buffer, OP_MSETSUB);
+                            }
 
                             // If it is a class field, we have to reassign it to the actual field / class
                             if(symbol->owner) {
@@ -1965,7 +2022,7 @@ datatype_t* compiler_eval(compiler_t* compiler, ast_t* node) {
 
 // Compiler.compileBuffer(string code)
 // Compiles code into bytecode instructions
-vector_t* compile_buffer(const char* name, char* source) {
+bytecode_t* compile_buffer(const char* name, char* source) {
     compiler_t compiler;
     compiler.context = context_new();
     compiler.parser = parser_new(name, compiler.context);
@@ -2001,13 +2058,13 @@ vector_t* compile_buffer(const char* name, char* source) {
         bytecode_buffer_free(buffer);
         return NULL;
     } else {
-        return buffer;
+        return bytecode_pack(buffer);
     }
 }
 
 // Compiler.compileFile(string filename)
 // Compiles a file into an instruction set
-vector_t* compile_file(const char* filename) {
+bytecode_t* compile_file(const char* filename) {
     char* source = readFile(filename);
     if(!source) {
         printf("File '%s' does not exist\n", filename);
@@ -2015,9 +2072,9 @@ vector_t* compile_file(const char* filename) {
     }
 
     // Compile into instructions
-    vector_t* buffer = compile_buffer(filename, source);
+    bytecode_t* bytecode = compile_buffer(filename, source);
     free(source);
-    return buffer;
+    return bytecode;
 }
 
 int free_import(void* val, void* arg) {
@@ -30,7 +30,7 @@ typedef struct compiler_t {
     int depth;
 } compiler_t;
 
-vector_t* compile_buffer(const char* name, char* source);
-vector_t* compile_file(const char* filename);
+bytecode_t* compile_buffer(const char* name, char* source);
+bytecode_t* compile_file(const char* filename);
 
 #endif
@@ -27,40 +27,38 @@ bool serialize_value(FILE* fp, val_t val) {
     return true;
 }
 
-bool serialize_instruction(FILE* fp, instruction_t* ins) {
+bool serialize_instruction(FILE* fp, bytecode_t* bytecode, code_t* code) {
     bool valid = true;
-    uint8_t opcode = ins->op;
+    uint8_t opcode = code->op;
     fwrite((const void*)&opcode, sizeof(uint8_t), 1, fp);
 
-    uint8_t args = 0;
-    if(ins->v1 != NULL_VAL) args++;
-    if(ins->v2 != NULL_VAL) args++;
+    uint8_t args = op_args(code->op);
     fwrite((const void*)&args, sizeof(uint8_t), 1, fp);
 
-    if(args > 0) {
-        valid &= serialize_value(fp, ins->v1);
-    }
-    if(args > 1) {
-        valid &= serialize_value(fp, ins->v2);
+    // Constants are written as values, plain operands as integers
+    if(code->op == OP_PUSH || code->op == OP_LDLIB) {
+        valid &= serialize_value(fp, bytecode->consts[code->a]);
+    } else {
+        if(args > 0) valid &= serialize_value(fp, INT32_VAL(code->a));
+        if(args > 1) valid &= serialize_value(fp, INT32_VAL(code->b));
     }
 
     return valid;
 }
 
-bool serialize(const char* filename, vector_t* buffer) {
+bool serialize(const char* filename, bytecode_t* bytecode) {
     FILE* fp = fopen(filename, "wb");
     if(!fp) return false;
 
     // Write magic number + amount of instructions to fetch
     uint32_t magic = 0xACCE55;
-    uint32_t codes = vector_size(buffer);
+    uint32_t codes = bytecode->len;
     fwrite((const void*)&magic, sizeof(uint32_t), 1, fp);
     fwrite((const void*)&codes, sizeof(uint32_t), 1, fp);
 
     bool valid = true;
-    for(size_t i = 0; i < vector_size(buffer); i++) {
-        instruction_t* ins = vector_get(buffer, i);
-        valid &= serialize_instruction(fp, ins);
+    for(size_t i = 0; i < bytecode->len; i++) {
+        valid &= serialize_instruction(fp, bytecode, &bytecode->code[i]);
     }
 
     fclose(fp);
@@ -92,7 +90,7 @@ val_t deserialize_value(FILE* fp) {
     return ret;
 }
 
-bool deserialize(const char* filename, vector_t** out) {
+bool deserialize(const char* filename, bytecode_t** out) {
     FILE* fp = fopen(filename, "rb");
     if(!fp) return false;
 
@@ -107,6 +105,7 @@ bool deserialize(const char* filename, vector_t** out) {
     }
 
     // Read the instructions
+    vector_t* buffer = vector_new();
     for(uint32_t i = 0; i < codes; i++) {
         instruction_t* ins = malloc(sizeof(*ins));
         ins->v1 = NULL_VAL;
@@ -121,9 +120,10 @@ bool deserialize(const char* filename, vector_t** out) {
         // Read the values
         if(args > 0) ins->v1 = deserialize_value(fp);
         if(args > 1) ins->v2 = deserialize_value(fp);
-        vector_push((*out), ins);
+        vector_push(buffer, ins);
     }
 
     fclose(fp);
+    *out = bytecode_pack(buffer);
     return true;
 }
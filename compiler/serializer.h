@@ -1,7 +1,7 @@
 /**
  * serializer.h
  * Copyright (C) 2017 Alexander Koch
- * Converts a list of bytecodes into a *.gvm-file and vice versa.
+ * Converts packed bytecode into a *.gvm-file and vice versa.
  */
 
 #ifndef serializer_h
@@ -30,6 +30,8 @@
  * If the type tag is a string,
  * the data is replaced by uint32_t len and char* str.
  *
+ * The argument count of an instruction is given by its opcode (see op_args).
+ *
  * EBNF (sort-of):
  * file = header, {instruction}
  * instruction = opcode, args, {value}
@@ -40,7 +42,7 @@
 #define TAG_BOOL 2
 #define TAG_STR 3
 
-bool serialize(const char* filename, vector_t* buffer);
-bool deserialize(const char* filename, vector_t** out);
+bool serialize(const char* filename, bytecode_t* bytecode);
+bool deserialize(const char* filename, bytecode_t** out);
 
 #endif
@@ -76,31 +76,53 @@ unsigned long djb2(unsigned char *str) {
     return hash;
 }
 
-char* readFile(const char* path) {
+FILE* openFile(const char* path, size_t* size) {
     FILE* file = fopen(path, "rb");
     if(!file) return 0;
 
-    // Get the size of the file
-    fseek(file, 0, SEEK_END);
-    size_t fileSize = ftell(file);
+    // Get the size of the file, directories can be opened, but not read
+    long fileSize = -1;
+    if(!fseek(file, 0, SEEK_END)) fileSize = ftell(file);
     rewind(file);
-
-    char* buffer = (char*)malloc(fileSize + 1);
-    if(!buffer) {
+    int c = fgetc(file);
+    if(fileSize < 0 || (c == EOF && ferror(file)) || (c != EOF && ungetc(c, file) == EOF)) {
         printf("Could not read file \"%s\".\n", path);
         fclose(file);
         return 0;
     }
 
-    size_t bytes = fread(buffer, sizeof(char), fileSize, file);
-    if(bytes < fileSize) {
+    *size = (size_t)fileSize;
+    return file;
+}
+
+bool readFileInto(FILE* file, const char* path, char* buffer, size_t size) {
+    size_t bytes = fread(buffer, sizeof(char), size, file);
+    fclose(file);
+    if(bytes < size) {
+        printf("Could not read file \"%s\".\n", path);
+        return false;
+    }
+
+    buffer[bytes] = '\0';
+    return true;
+}
+
+char* readFile(const char* path) {
+    size_t fileSize;
+    FILE* file = openFile(path, &fileSize);
+    if(!file) return 0;
+
+    char* buffer = (char*)malloc(fileSize + 1);
+    if(!buffer) {
         printf("Could not read file \"%s\".\n", path);
         fclose(file);
         return 0;
     }
 
-    buffer[bytes] = '\0';
-    fclose(file);
+    if(!readFileInto(file, path, buffer, fileSize)) {
+        free(buffer);
+        return 0;
+    }
     return buffer;
 }
 
@@ -122,8 +144,7 @@ char* replaceExt(char* filename, const char* ext, size_t len) {
     memset(mem, 0, idx+len+1);
     memcpy(mem, x-idx, idx);
     memcpy(mem+idx, ext, len);
-    idx += len+1;
-    mem[idx] = '\0';
+    mem[idx+len] = '\0';
     return mem;
 }
 
@@ -10,6 +10,7 @@
 #include <core/mem.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -32,6 +33,11 @@ char* strf(const char* fmt, ...);
 unsigned long djb2(unsigned char* str);
 
 // File reading methods
+// Opens a readable file and stores its size, prints a message if it can not be read
+FILE* openFile(const char* path, size_t* size);
+// Reads @size bytes of the opened file into @buffer (with room for the trailing zero),
+// the file is closed
+bool readFileInto(FILE* file, const char* path, char* buffer, size_t size);
 char* readFile(const char* path);
 char* replaceExt(char* filename, const char* ext, size_t len);
 char* getDirectory(const char* path);
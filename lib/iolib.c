@@ -15,10 +15,23 @@ extern int mathlib_fn_count;
  * 02 writeFile
  */
 
+// The file is read into the string directly, the data of large files
+// is allocated in the large-object space (see obj_string_buffer_new)
 void io_readFile(vm_t* vm) {
 	char* path = AS_STRING(vm_pop(vm));
-	char* buffer = readFile(path);
-    vm_register(vm, (!buffer) ? STRING_VAL("") : STRING_NOCOPY_VAL(buffer));
+	size_t fileSize;
+	FILE* file = openFile(path, &fileSize);
+	if(!file) {
+		vm_register(vm, STRING_VAL(""));
+		return;
+	}
+
+	// Nothing is kept of a short read
+	obj_t* obj = obj_string_buffer_new(fileSize);
+	if(!readFileInto(file, path, obj->data, fileSize)) {
+		obj_string_shrink(obj, 0);
+	}
+	vm_register(vm, OBJ_VAL(obj));
 }
 
 void io_writeFile(vm_t* vm) {
@@ -15,9 +15,13 @@
 #include <parser/parser.h>
 #include <parser/types.h>
 #include <vm/vm.h>
+#include <vm/regcode.h>
+#include <vm/jit.h>
+#include <vm/parmark.h>
 #include <compiler/compiler.h>
 #include <compiler/serializer.h>
 #include <compiler/graphviz.h>
+#include <compiler/cgen.h>
 
 void print_info(void) {
     printf("Golem compiler\n");
@@ -26,7 +30,18 @@ void print_info(void) {
     printf("  golem <file>       (Run a file)\n");
     printf("  golem -r <file>    (Run a *.gvm file)\n");
     printf("  golem -c <file>    (Convert to bytecode file *.gvm)\n");
+    printf("  golem --reg <file> (Run a file on the register VM)\n");
+    printf("  golem --jit <file> (Run a file, hot functions are compiled to native code)\n");
+    printf("  golem --incremental <file> (Run a file, the garbage collector works in bounded slices)\n");
+    printf("  golem --parallel <file> (Run a file, the garbage collector marks with all processors)\n");
     printf("  golem --ast <file> (Convert generated AST to graph *.dot)\n");
+    printf("  golem --emit-c <file> (Translate to C code *.c, see cgen.h)\n");
+    printf("\nEnvironment:\n");
+    printf("  GOLEM_GC_INITIAL=<size>  (Old objects in bytes before the first full collection, e.g. 16M)\n");
+    printf("  GOLEM_GC_GROWTH=<factor> (Growth of the heap until the next full collection, at least 1)\n");
+    printf("  GOLEM_GC_MAX=<size>      (Maximum heap target in bytes, collections get more frequent near it)\n");
+    printf("  GOLEM_GC_COMPACT=<0|1>   (Compaction of sparse pages after a full collection, on by default)\n");
+    printf("  GOLEM_GC_THREADS=<n>     (Threads marking the heap in parallel, for heaps of any size)\n");
 }
 
 int main(int argc, char** argv) {
@@ -35,30 +50,79 @@ int main(int argc, char** argv) {
 
     if(argc == 2) {
         // Generate and execute bytecode (Interpreter)
-        vector_t* buffer = compile_file(argv[1]);
-        if(buffer) {
-            vm_run_args(&vm, buffer, argc, argv);
+        bytecode_t* bytecode = compile_file(argv[1]);
+        if(bytecode) {
+            vm_run_args(&vm, bytecode, argc, argv);
         }
-        bytecode_buffer_free(buffer);
+        bytecode_free(bytecode);
     } else if(argc == 3) {
         if(!strcmp(argv[1], "-c")) {
             // Compile to bytecode
-            vector_t* buffer = compile_file(argv[2]);
-            if(buffer) {
+            bytecode_t* bytecode = compile_file(argv[2]);
+            if(bytecode) {
                 // Write to file
                 char* out = replaceExt(argv[2], ".gvm", 4);
-                serialize(out, buffer);
+                serialize(out, bytecode);
                 printf("Wrote bytecode to file '%s'\n", out);
                 free(out);
             }
-            bytecode_buffer_free(buffer);
+            bytecode_free(bytecode);
         } else if(!strcmp(argv[1], "-r")) {
             // Run compiled bytecode file
-            vector_t* buffer = vector_new();
-            if(deserialize(argv[2], &buffer)) {
-                vm_run_args(&vm, buffer, argc, argv);
+            bytecode_t* bytecode = 0;
+            if(deserialize(argv[2], &bytecode)) {
+                vm_run_args(&vm, bytecode, argc, argv);
             }
-            bytecode_buffer_free(buffer);
+            bytecode_free(bytecode);
+        } else if(!strcmp(argv[1], "--reg")) {
+            // Translate to register code and execute
+            bytecode_t* bytecode = compile_file(argv[2]);
+            if(bytecode) {
+                if(!regcode_translate(bytecode)) {
+                    printf("Could not translate to register code, using the stack VM\n");
+                }
+                vm_run_args(&vm, bytecode, argc, argv);
+            }
+            bytecode_free(bytecode);
+        } else if(!strcmp(argv[1], "--jit")) {
+            // Execute with the JIT
+            bytecode_t* bytecode = compile_file(argv[2]);
+            if(bytecode) {
+                vm.jit = jit_new();
+                if(!vm.jit) {
+                    printf("The JIT is not available on this platform, using the interpreter\n");
+                }
+                vm_run_args(&vm, bytecode, argc, argv);
+                jit_free(vm.jit);
+            }
+            bytecode_free(bytecode);
+        } else if(!strcmp(argv[1], "--incremental")) {
+            // Execute with the incremental garbage collector
+            bytecode_t* bytecode = compile_file(argv[2]);
+            if(bytecode) {
+                vm.gcSlice = GC_SLICE;
+                vm_run_args(&vm, bytecode, argc, argv);
+            }
+            bytecode_free(bytecode);
+        } else if(!strcmp(argv[1], "--parallel")) {
+            // Execute with parallel marking of large heaps
+            bytecode_t* bytecode = compile_file(argv[2]);
+            if(bytecode) {
+                vm.gcThreads = parmark_threads();
+                vm_run_args(&vm, bytecode, argc, argv);
+            }
+            bytecode_free(bytecode);
+        } else if(!strcmp(argv[1], "--emit-c")) {
+            // Translate to C, before the code is modified for execution
+            bytecode_t* bytecode = compile_file(argv[2]);
+            if(bytecode) {
+                char* out = replaceExt(argv[2], ".c", 2);
+                if(cgen_emit(bytecode, out, argv[2])) {
+                    printf("Wrote C code to file '%s'\n", out);
+                }
+                free(out);
+            }
+            bytecode_free(bytecode);
         } else if(!strcmp(argv[1], "--ast")) {
             // Generate ast.dot graphviz file
             char* path = argv[2];
@@ -0,0 +1,30 @@
+# add() on a mutable array, earlier copies keep their length and elements.
+using core
+
+let mut xs = [1, 2, 3]
+let before = xs
+xs := xs.add(4)
+println(before.length())
+println(xs.length())
+println(xs[3])
+
+# The payload is larger than the large-object threshold
+let mut big = [0]
+let mut i = 1
+while i < 20000 {
+    big := big.add(i)
+    i := i + 1
+}
+let snapshot = big
+big := big.add(20000)
+println(snapshot.length())
+println(big.length())
+println(snapshot[19999])
+println(big[20000])
+
+# Both appends start from the same length
+let shared = big
+big := big.add(1)
+let other = shared.add(2)
+println(big[20001])
+println(other[20001])
@@ -0,0 +1,64 @@
+# Assigned arrays and objects are copies, changing the copy keeps the original.
+using core
+
+let a = [1, 2, 3]
+let mut b = a
+b[0] := 10
+println(a)
+println(b)
+
+let nested = [[1, 2], [3, 4]]
+let mut n2 = nested
+let mut row = n2[0]
+row[1] := 20
+n2[0] := row
+println(nested)
+println(n2)
+
+let mut inner = nested[1]
+inner[0] := 30
+println(nested)
+println(inner)
+
+type Box(v: int[]) {
+    @Getter
+    let mut items = v
+
+    func set(i: int, x: int) {
+        items[i] := x
+    }
+}
+
+let box = Box(a)
+box.set(1, 40)
+println(a)
+println(box.getItems())
+
+let mut fromBox = box.getItems()
+fromBox[2] := 50
+println(box.getItems())
+println(fromBox)
+
+let box2 = box
+box2.set(0, 60)
+println(box.getItems())
+println(box2.getItems())
+
+func change(arr: int[]) -> int[] {
+    let mut copy = arr
+    copy[0] := 70
+    return copy
+}
+
+let changed = change(a)
+println(a)
+println(changed)
+
+func make() -> int[] {
+    return a
+}
+
+let mut made = make()
+made[1] := 80
+println(a)
+println(made)
@@ -0,0 +1,104 @@
+# Allocates many short-lived objects beside long-lived ones, so the collector runs
+# minor and full collections while the program works.
+using core
+
+type Pair(a: int, b: int[]) {
+    @Getter
+    let first = a
+    @Getter
+    let mut second = b
+
+    func swap(c: int[]) {
+        second := c
+    }
+}
+
+# Short-lived objects, most of them die in the nursery
+let mut sum = 0
+let mut i = 0
+while i < 1000 {
+    let tmp = [i, i + 1, i + 2]
+    let s = "tmp$i"
+    let p = Pair(i, tmp)
+    sum := sum + p.getFirst()
+    i := i + 1
+}
+println(sum)
+
+# Long-lived objects, that are promoted and referenced from old ones
+let mut keep = [[0, 0]]
+i := 1
+while i < 4000 {
+    keep := keep.add([i, 2 * i])
+    i := i + 1
+}
+println(keep.length())
+
+let mut pairs = [Pair(0, [0])]
+i := 1
+while i < 2000 {
+    pairs := pairs.add(Pair(i, keep[i]))
+    pairs[i - 1].swap([i])
+    i := i + 1
+}
+let mut total = 0
+i := 0
+while i < 2000 {
+    total := total + keep[i][1] + pairs[i].getFirst()
+    i := i + 1
+}
+println(total)
+
+# Most of the promoted objects die, their pages become sparse
+let mut survivors = [[0]]
+i := 0
+while i < 40000 {
+    let row = [i, i]
+    if i % 250 = 0 {
+        survivors := survivors.add(row)
+    }
+    i := i + 1
+}
+let mut check = 0
+i := 0
+while i < survivors.length() {
+    check := check + survivors[i][0]
+    i := i + 1
+}
+println(check)
+println(survivors.length() - 1)
+
+# Large payloads (arrays and strings), replaced in a loop
+let mut big = [0]
+i := 1
+while i < 65536 {
+    big := big.add(1)
+    i := i + 1
+}
+let mut text = "ab"
+i := 0
+while i < 18 {
+    text := text.append(text)
+    i := i + 1
+}
+println(text.length())
+let mut copies = 0
+i := 0
+while i < 30 {
+    let mut next = big.append([i])
+    next[0] := i
+    copies := copies + next.length()
+    i := i + 1
+}
+println(copies)
+
+# Deep recursion, the dead locals of the callers are not roots
+func depth(n: int) -> int {
+    let garbage = [n, n, n]
+    let more = "depth$n"
+    if n = 0 {
+        return 0
+    }
+    return garbage[0] + depth(n - 1)
+}
+println(depth(50))
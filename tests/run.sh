@@ -0,0 +1,55 @@
+#!/bin/sh
+# Runs the tests in every mode of the vm and as C code (golem --emit-c).
+# Every mode has to print the same as the default run, a test with a .out file
+# has to print its contents. Build with `make` and `make lib` first, or run `make test`.
+# Usage: tests/run.sh [golem]
+
+GOLEM=$(cd "$(dirname "${1:-./golem}")" && pwd)/$(basename "${1:-./golem}")
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+failed=0
+
+# The random numbers are seeded with the time
+SKIP="monte_carlo_pi"
+
+# Compares the output of a test in one mode with the expected output
+check() {
+    if ! cmp -s "$2" "$3"; then
+        echo "FAIL $1 ($4)"
+        diff "$2" "$3" | head -10
+        failed=1
+    fi
+}
+
+for test in "$ROOT"/tests/*.gs; do
+    name=$(basename "$test" .gs)
+    case " $SKIP " in *" $name "*) continue;; esac
+    "$GOLEM" "$test" < /dev/null > "$OUT/$name" 2>&1
+    if [ -f "$ROOT/tests/$name.out" ]; then
+        check "$name" "$ROOT/tests/$name.out" "$OUT/$name" "expected"
+    fi
+
+    # The register vm reports a fallback to the stack vm
+    for mode in --reg --jit --incremental --parallel; do
+        "$GOLEM" $mode "$test" < /dev/null 2>&1 | grep -v "^Could not translate" > "$OUT/$name$mode"
+        check "$name" "$OUT/$name" "$OUT/$name$mode" "$mode"
+    done
+
+    # Collections after every few objects
+    GOLEM_GC_INITIAL=1K "$GOLEM" --incremental "$test" < /dev/null > "$OUT/$name.gc" 2>&1
+    check "$name" "$OUT/$name" "$OUT/$name.gc" "GOLEM_GC_INITIAL=1K"
+    GOLEM_GC_THREADS=4 "$GOLEM" --parallel "$test" < /dev/null > "$OUT/$name.par" 2>&1
+    check "$name" "$OUT/$name" "$OUT/$name.par" "GOLEM_GC_THREADS=4"
+
+    cp "$test" "$OUT/$name.gs"
+    "$GOLEM" --emit-c "$OUT/$name.gs" > /dev/null 2>&1
+    if [ -f "$OUT/$name.c" ] && \
+        ${CC:-cc} -O2 -std=c99 -w -I"$ROOT" "$OUT/$name.c" "$ROOT/libgolem.a" -lm -pthread -o "$OUT/$name.bin"; then
+        "$OUT/$name.bin" < /dev/null > "$OUT/$name.aot" 2>&1
+        check "$name" "$OUT/$name" "$OUT/$name.aot" "--emit-c"
+    fi
+done
+
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed
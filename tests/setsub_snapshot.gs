@@ -0,0 +1,28 @@
+# Element stores into a mutable array do not change the copies taken before.
+using core
+
+let mut xs = [1, 2, 3]
+let small = xs
+xs[0] := 100
+println(small[0])
+println(xs[0])
+
+# The payload is larger than the large-object threshold
+let mut big = [0]
+let mut i = 1
+while i < 20000 {
+    big := big.add(i)
+    i := i + 1
+}
+let snapshot = big
+i := 0
+while i < 20000 {
+    big[i] := 2 * i
+    i := i + 1
+}
+big[1] := 200
+println(snapshot[2])
+println(big[1])
+println(snapshot.length())
+println(big[19999])
+println(snapshot[19999])
@@ -9,27 +9,18 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
-	vector_t* buffer = vector_new();
-	if(deserialize(argv[1], &buffer)) {
-		for(size_t i = 0; i < vector_size(buffer); i++) {
-			instruction_t* instr = vector_get(buffer, i);
-
+	bytecode_t* bytecode = 0;
+	if(deserialize(argv[1], &bytecode)) {
+		for(size_t i = 0; i < bytecode->len; i++) {
 			// Print
-			printf("%.2u: %s", (unsigned int)i, op2str(instr->op));
-			if(instr->v1 != NULL_VAL) {
-				printf(", ");
-				val_print(instr->v1);
-			}
-			if(instr->v2 != NULL_VAL) {
-				printf(", ");
-				val_print(instr->v2);
-			}
+			printf("%.2u: ", (unsigned int)i);
+			bytecode_print(bytecode, i);
 			putchar('\n');
 		}
 	} else {
 		printf("Could not read file '%s'\n", argv[1]);
 	}
 
-	bytecode_buffer_free(buffer);
+	bytecode_free(bytecode);
 	return 0;
 }
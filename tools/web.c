@@ -7,10 +7,10 @@ int golem_interpret(const char* module, char* source) {
     seed_prng(time(0));
 	vm_t vm;
 	memset(&vm, 0, sizeof(vm_t));
-	vector_t* buffer = compile_buffer(source, module);
-	if(buffer) {
-		vm_run(&vm, buffer);
-		bytecode_buffer_free(buffer);
+	bytecode_t* bytecode = compile_buffer(source, module);
+	if(bytecode) {
+		vm_run(&vm, bytecode);
+		bytecode_free(bytecode);
 	}
 	return 0;
 }
@@ -0,0 +1,216 @@
+// Copyright (C) 2017 Alexander Koch
+#include "aot.h"
+#include <setjmp.h>
+#include <core/util.h>
+
+// Return point of aot_run for exceptions
+static jmp_buf escape;
+
+void aot_run(vm_t* vm, aot_main_t fn, int size, int argc, char** argv) {
+    seed_prng(time(0));
+    vm->argc = argc;
+    vm->argv = argv;
+    vm_gc_config(vm);
+    vm->errjmp = -1;
+
+    // New objects are registered in the nursery
+    obj_nursery = &vm->young;
+    if(size >= STACK_SIZE) {
+        vm_throw(vm, "Stack overflow");
+    } else if(!setjmp(escape)) {
+        fn(vm);
+    }
+    vm_clear(vm);
+    obj_nursery = 0;
+}
+
+val_t* aot_invoke(vm_t* vm, val_t* fp, val_t* sp, int args, int size, int pc) {
+    // Same frame layout as the interpreter (see code_invoke)
+    val_t* stack = vm->stack;
+    if(sp + 3 + size > stack + STACK_SIZE) {
+        vm->pc = pc + 1;
+        vm->sp = sp - stack;
+        vm->fp = fp - stack;
+        vm_throw(vm, "Stack overflow");
+        longjmp(escape, 1);
+    }
+
+    for(val_t* v = stack + vm->lp; v < sp; v++) {
+        RETAIN_VAL(*v);
+    }
+    vm->frames[vm->depth++] = vm->lp;
+
+    *sp++ = aot_int_val(args);
+    *sp++ = aot_int_val(fp - stack);
+    *sp++ = aot_int_val(pc + 1);
+    vm->lp = sp - stack;
+    vm->bases[vm->depth - 1] = vm->lp;
+    return sp;
+}
+
+// Removes the frame, the return value is stored below the arguments (see LEAVE)
+val_t* aot_leave(vm_t* vm, val_t* fp, val_t* sp) {
+    for(val_t* v = fp; v < sp; v++) {
+        RELEASE_VAL(*v);
+    }
+
+    int args = aot_int(fp[-3]);
+    sp = fp - 3;
+    vm->lp = vm->frames[--vm->depth];
+    for(val_t* v = vm->stack + vm->lp; v < sp; v++) {
+        RELEASE_VAL(*v);
+    }
+    return sp - args;
+}
+
+void aot_ret(vm_t* vm, val_t* fp, val_t* sp) {
+    val_t ret = sp[-1];
+    sp = aot_leave(vm, fp, sp - 1);
+    sp[0] = ret;
+}
+
+void aot_retvirtual(vm_t* vm, val_t* fp, val_t* sp) {
+    // The class is kept on top of the return value
+    val_t ret = sp[-1];
+    sp = aot_leave(vm, fp, sp - 1);
+    val_t clazz = sp[-1];
+    sp[-1] = ret;
+    sp[0] = clazz;
+}
+
+void aot_syscall(vm_t* vm, val_t* fp, val_t* sp, int index, int pc) {
+    // Exceptions move the program counter to the error handler (see vm_throw)
+    vm->pc = pc + 1;
+    vm->sp = sp - vm->stack;
+    vm->fp = fp - vm->stack;
+    vm_syscall(vm, index);
+    if(vm->pc != pc + 1) {
+        longjmp(escape, 1);
+    }
+}
+
+void aot_halt(vm_t* vm) {
+    longjmp(escape, 1);
+}
+
+void aot_arr(vm_t* vm, val_t* sp, int elsz) {
+    // The array becomes an owner of the elements
+    obj_t* obj = obj_array_new(elsz);
+    val_t* arr = ((obj_array_t*)obj->data)->data;
+    for(int i = elsz; i > 0; i--) {
+        val_t val = sp[-i];
+        RETAIN_VAL(val);
+        arr[elsz - i] = val;
+    }
+
+    vm->sp = sp - elsz - vm->stack;
+    vm_register(vm, OBJ_VAL(obj));
+}
+
+void aot_str(vm_t* vm, val_t* sp, int elsz) {
+    obj_t* obj = obj_string_buffer_new(elsz);
+    char* str = obj->data;
+    for(int i = elsz; i > 0; i--) {
+        str[elsz - i] = (char)aot_int(sp[-i]);
+    }
+    str[elsz] = '\0';
+
+    vm->sp = sp - elsz - vm->stack;
+    vm_register(vm, OBJ_VAL(obj));
+}
+
+void aot_tostr(vm_t* vm, val_t* sp) {
+    val_t str = STRING_NOCOPY_VAL(val_tostr(sp[-1]));
+    vm->sp = sp - 1 - vm->stack;
+    vm_register(vm, str);
+}
+
+void aot_append(vm_t* vm, val_t* sp) {
+    val_t result;
+    if(IS_STRING(sp[-2])) {
+        char* str1 = AS_STRING(sp[-2]);
+        char* str2 = AS_STRING(sp[-1]);
+        size_t len1 = strlen(str1);
+        size_t len2 = strlen(str2);
+        obj_t* obj = obj_string_buffer_new(len1 + len2);
+        memcpy(obj->data, str1, len1);
+        memcpy((char*)obj->data + len1, str2, len2 + 1);
+        result = OBJ_VAL(obj);
+    } else {
+        obj_array_t* arr1 = AS_ARRAY(sp[-2]);
+        obj_array_t* arr2 = AS_ARRAY(sp[-1]);
+        size_t len = arr1->len + arr2->len;
+        obj_t* obj = obj_array_new(len);
+        val_t* data = ((obj_array_t*)obj->data)->data;
+        for(size_t i = 0; i < arr1->len; i++) {
+            data[i] = arr1->data[i];
+            RETAIN_VAL(data[i]);
+        }
+        for(size_t i = 0; i < arr2->len; i++) {
+            data[i+arr1->len] = arr2->data[i];
+            RETAIN_VAL(data[i+arr1->len]);
+        }
+        result = OBJ_VAL(obj);
+    }
+
+    vm->sp = sp - 2 - vm->stack;
+    vm_register(vm, result);
+}
+
+// The operands stay on the stack, until the object is owned (see code_setsub).
+// A copy replaces an operand, before the collector is polled.
+void aot_setsub(vm_t* vm, val_t* sp) {
+    vm->sp = sp - vm->stack;
+    obj_t* src = AS_OBJ(sp[-2]);
+    obj_t* obj = vm_unshare(vm, src, 0);
+    vm_setsub(vm, obj, aot_int(sp[-1]), sp[-3]);
+    sp[-3] = OBJ_VAL(obj);
+    if(obj != src) vm_gc_poll(vm);
+}
+
+void aot_msetsub(vm_t* vm, val_t* sp) {
+    vm->sp = sp - vm->stack;
+    obj_t* src = AS_OBJ(sp[-1]);
+    obj_t* obj = vm_unshare(vm, src, 1);
+    vm_setsub(vm, obj, aot_int(sp[-2]), sp[-3]);
+    sp[-3] = OBJ_VAL(obj);
+    if(obj != src) vm_gc_poll(vm);
+}
+
+void aot_cons(vm_t* vm, val_t* sp) {
+    vm->sp = sp - vm->stack;
+    obj_t* src = AS_OBJ(sp[-2]);
+    obj_t* obj = vm_cons(vm, src, sp[-1], 0);
+    sp[-2] = OBJ_VAL(obj);
+    if(obj != src) vm_gc_poll(vm);
+}
+
+void aot_mcons(vm_t* vm, val_t* sp) {
+    vm->sp = sp - vm->stack;
+    obj_t* src = AS_OBJ(sp[-1]);
+    obj_t* obj = vm_cons(vm, src, sp[-2], 1);
+    sp[-2] = OBJ_VAL(obj);
+    if(obj != src) vm_gc_poll(vm);
+}
+
+void aot_class(vm_t* vm, val_t* sp, int fields) {
+    vm->sp = sp - vm->stack;
+    vm_register(vm, OBJ_VAL(obj_class_new(fields)));
+}
+
+void aot_setfield(vm_t* vm, val_t* sp, int index) {
+    // The class is either new or owned by the argument 0 slot
+    val_t val = sp[-1];
+    vm->sp = sp - vm->stack;
+    obj_t* src = AS_OBJ(sp[-2]);
+    obj_t* obj = vm_unshare(vm, src, 1);
+
+    obj_class_t* cls = obj->data;
+    val_t old = cls->fields[index];
+    RETAIN_VAL(val);
+    RELEASE_VAL(old);
+    cls->fields[index] = val;
+    vm_write_barrier(vm, obj, old, val);
+    sp[-2] = OBJ_VAL(obj);
+    if(obj != src) vm_gc_poll(vm);
+}
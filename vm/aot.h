@@ -0,0 +1,88 @@
+/**
+ * aot.h
+ * Copyright (C) 2017 Alexander Koch
+ * Runtime of programs compiled to C (golem --emit-c, see cgen.h)
+ *
+ * Compiled programs use the vm stack, the garbage collector and the native functions
+ * of the interpreter. Every function works on its frame at fp like the interpreter,
+ * calls push the same frame header. Values of the operand stack are kept in C expressions
+ * (integers and doubles unboxed) and are only stored, before the stack is used.
+ *
+ * The helpers work like the handlers of vm_exec, @sp is the stack pointer before the instruction.
+ * Build the runtime with `make lib` and link the generated file against libgolem.a.
+ */
+
+#ifndef aot_h
+#define aot_h
+
+#include <string.h>
+#include <vm/vm.h>
+
+// Top-level code of a compiled program
+typedef void (*aot_main_t)(vm_t* vm);
+
+// Unboxing without calls, integers are stored in the lower 32 bits (see val_of_int32)
+static inline int aot_int(val_t v) {
+    return (int32_t)(uint32_t)v;
+}
+
+static inline val_t aot_int_val(int i) {
+    return (val_t)(uint32_t)i;
+}
+
+static inline double aot_num(val_t v) {
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+static inline val_t aot_num_val(double d) {
+    val_t v;
+    memcpy(&v, &d, sizeof(v));
+    return v;
+}
+
+static inline val_t aot_getsub(val_t obj, int idx) {
+    if(IS_STRING(obj)) return aot_int_val(AS_STRING(obj)[idx]);
+    return AS_ARRAY(obj)->data[idx];
+}
+
+static inline int aot_len(val_t obj) {
+    if(IS_STRING(obj)) return strlen(AS_STRING(obj));
+    return AS_ARRAY(obj)->len;
+}
+
+// Frame of the enclosing scope (upval, upstore)
+static inline val_t* aot_frame(vm_t* vm, val_t* fp, int scopes) {
+    for(int i = 0; i < scopes; i++) {
+        fp = vm->stack + aot_int(fp[-2]);
+    }
+    return fp;
+}
+
+/**
+ * Runs the program, @size is the stack size of the top-level code.
+ * Exceptions end the program like in the interpreter.
+ */
+void aot_run(vm_t* vm, aot_main_t fn, int size, int argc, char** argv);
+
+// Calls and returns, @pc is the index of the instruction (used in the frame header and for errors)
+val_t* aot_invoke(vm_t* vm, val_t* fp, val_t* sp, int args, int size, int pc);
+void aot_ret(vm_t* vm, val_t* fp, val_t* sp);
+void aot_retvirtual(vm_t* vm, val_t* fp, val_t* sp);
+void aot_syscall(vm_t* vm, val_t* fp, val_t* sp, int index, int pc);
+void aot_halt(vm_t* vm);
+
+// Instructions that allocate or modify objects
+void aot_arr(vm_t* vm, val_t* sp, int elsz);
+void aot_str(vm_t* vm, val_t* sp, int elsz);
+void aot_tostr(vm_t* vm, val_t* sp);
+void aot_append(vm_t* vm, val_t* sp);
+void aot_setsub(vm_t* vm, val_t* sp);
+void aot_msetsub(vm_t* vm, val_t* sp);
+void aot_cons(vm_t* vm, val_t* sp);
+void aot_mcons(vm_t* vm, val_t* sp);
+void aot_class(vm_t* vm, val_t* sp, int fields);
+void aot_setfield(vm_t* vm, val_t* sp, int index);
+
+#endif
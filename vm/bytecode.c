@@ -78,10 +78,129 @@ const char* op2str(opcode_t code) {
         case OP_CLASS: return "class";
         case OP_SETFIELD: return "setfield";
         case OP_GETFIELD: return "getfield";
+        case OP_MSETSUB: return "msetsub";
+        case OP_MCONS: return "mcons";
+        case OP_LLIADD: return "ll_iadd";
+        case OP_LKIADD: return "lk_iadd";
+        case OP_LKISUB: return "lk_isub";
+        case OP_LINC: return "l_inc";
+        case OP_GINC: return "g_inc";
+        case OP_ILTJMPF: return "ilt_jmpf";
+        case OP_LKILTJMPF: return "lk_ilt_jmpf";
+        case OP_LDFIELD: return "ldarg0_getfield";
+        case OP_RMOV: return "rmov";
+        case OP_RMOVG: return "rmovg";
+        case OP_RMOVK: return "rmovk";
+        case OP_RJMPF: return "rjmpf";
+        case OP_RIADD: return "riadd";
+        case OP_RISUB: return "risub";
+        case OP_RIMUL: return "rimul";
+        case OP_RIDIV: return "ridiv";
+        case OP_RMOD: return "rmod";
+        case OP_RIEQ: return "rieq";
+        case OP_RINE: return "rine";
+        case OP_RILT: return "rilt";
+        case OP_RIGT: return "rigt";
+        case OP_RILE: return "rile";
+        case OP_RIGE: return "rige";
+        case OP_RIADDK: return "riaddk";
+        case OP_RISUBK: return "risubk";
+        case OP_RIEQK: return "rieqk";
+        case OP_RINEK: return "rinek";
+        case OP_RILTK: return "riltk";
+        case OP_RIGTK: return "rigtk";
+        case OP_RILEK: return "rilek";
+        case OP_RIGEK: return "rigek";
+        case OP_RFADD: return "rfadd";
+        case OP_RFSUB: return "rfsub";
+        case OP_RFMUL: return "rfmul";
+        case OP_RFDIV: return "rfdiv";
+        case OP_RFLT: return "rflt";
+        case OP_RFGT: return "rfgt";
+        case OP_RFLE: return "rfle";
+        case OP_RFGE: return "rfge";
+        case OP_RRET: return "rret";
+        case OP_RIEQJ: return "rieq_jmpf";
+        case OP_RINEJ: return "rine_jmpf";
+        case OP_RILTJ: return "rilt_jmpf";
+        case OP_RIGTJ: return "rigt_jmpf";
+        case OP_RILEJ: return "rile_jmpf";
+        case OP_RIGEJ: return "rige_jmpf";
+        case OP_RIEQKJ: return "rieqk_jmpf";
+        case OP_RINEKJ: return "rinek_jmpf";
+        case OP_RILTKJ: return "riltk_jmpf";
+        case OP_RIGTKJ: return "rigtk_jmpf";
+        case OP_RILEKJ: return "rilek_jmpf";
+        case OP_RIGEKJ: return "rigek_jmpf";
+        case OP_PUSHK: return "pushk";
+        case OP_AGETSUB: return "agetsub";
+        case OP_SGETSUB: return "sgetsub";
+        case OP_ALEN: return "alen";
+        case OP_SLEN: return "slen";
+        case OP_AAPPEND: return "aappend";
+        case OP_SAPPEND: return "sappend";
         default: return "undefined";
     }
 }
 
+// Number of operands of an opcode
+int op_args(opcode_t code) {
+    switch(code) {
+        case OP_PUSH:
+        case OP_STORE:
+        case OP_LOAD:
+        case OP_GSTORE:
+        case OP_GLOAD:
+        case OP_SYSCALL:
+        case OP_RESERVE:
+        case OP_JMP:
+        case OP_JMPF:
+        case OP_ARR:
+        case OP_STR:
+        case OP_LDLIB:
+        case OP_CLASS:
+        case OP_SETFIELD:
+        case OP_GETFIELD:
+        case OP_ILTJMPF:
+        case OP_LDFIELD:
+        case OP_RRET:
+        case OP_PUSHK: return 1;
+        case OP_INVOKE:
+        case OP_UPVAL:
+        case OP_UPSTORE:
+        case OP_LLIADD:
+        case OP_LKIADD:
+        case OP_LKISUB:
+        case OP_LINC:
+        case OP_GINC:
+        case OP_RMOV:
+        case OP_RMOVG:
+        case OP_RMOVK:
+        case OP_RJMPF: return 2;
+        case OP_LKILTJMPF: return 3;
+        default: {
+            if(code >= OP_RIADD && code <= OP_RFGE) return 3;
+            if(code >= OP_RIEQJ && code <= OP_RIGEKJ) return 3;
+            return 0;
+        }
+    }
+}
+
+int* bytecode_target(code_t* code) {
+    switch(code->op) {
+        case OP_JMP:
+        case OP_JMPF:
+        case OP_INVOKE:
+        case OP_ILTJMPF: return &code->a;
+        case OP_RJMPF: return &code->b;
+        case OP_LKILTJMPF: return &code->c;
+        default: {
+            if(code->op >= OP_RIEQJ && code->op <= OP_RIGEKJ) return &code->c;
+            return 0;
+        }
+    }
+}
+
 instruction_t* instruction_new(opcode_t op) {
     instruction_t* ins = malloc(sizeof(*ins));
     ins->op = op;
@@ -297,6 +416,156 @@ val_t* emit_jmpf(vector_t* buffer, int address) {
     return GEN_JMP_REF();
 }
 
+bytecode_t* bytecode_pack(vector_t* buffer) {
+    size_t len = vector_size(buffer);
+    bytecode_t* bytecode = malloc(sizeof(*bytecode));
+    bytecode->code = malloc(sizeof(code_t) * len);
+    bytecode->len = len;
+    bytecode->consts = 0;
+    bytecode->num_consts = 0;
+
+    size_t cap = 0;
+    for(size_t i = 0; i < len; i++) {
+        instruction_t* instr = vector_get(buffer, i);
+        code_t* code = &bytecode->code[i];
+        code->op = instr->op;
+        code->h = 0;
+        code->a = 0;
+        code->b = 0;
+        code->c = 0;
+
+        if(instr->op == OP_PUSH || instr->op == OP_LDLIB) {
+            // Generic value => constant table
+            if(bytecode->num_consts >= cap) {
+                cap = (cap < 8) ? 8 : cap * 2;
+                bytecode->consts = realloc(bytecode->consts, sizeof(val_t) * cap);
+            }
+            code->a = bytecode->num_consts;
+            bytecode->consts[bytecode->num_consts++] = instr->v1;
+        } else {
+            if(instr->v1 != NULL_VAL) code->a = AS_INT32(instr->v1);
+            if(instr->v2 != NULL_VAL) code->b = AS_INT32(instr->v2);
+        }
+        free(instr);
+    }
+
+    vector_free(buffer);
+    return bytecode;
+}
+
+// Prints the instruction at @pc
+void bytecode_print(bytecode_t* bytecode, size_t pc) {
+    code_t* code = &bytecode->code[pc];
+    printf("%s", op2str(code->op));
+
+    int args = op_args(code->op);
+    if(code->op == OP_PUSH || code->op == OP_PUSHK || code->op == OP_LDLIB) {
+        printf(", ");
+        val_print(bytecode->consts[code->a]);
+    } else if(code->op == OP_RMOVK) {
+        printf(", %d, ", code->a);
+        val_print(bytecode->consts[code->b]);
+    } else if(args > 0) {
+        printf(", %d", code->a);
+        if(args > 1) printf(", %d", code->b);
+        if(args > 2) printf(", %d", code->c);
+    }
+}
+
+// Superinstruction definition
+// @ops is the replaced sequence, the first @len opcodes are used.
+typedef struct {
+    opcode_t fused;
+    int len;
+    opcode_t ops[4];
+} fusion_t;
+
+// Longer sequences come first
+static const fusion_t fusions[] = {
+    {OP_LKILTJMPF, 4, {OP_LOAD, OP_PUSH, OP_ILT, OP_JMPF}},
+    {OP_LINC, 4, {OP_LOAD, OP_PUSH, OP_IADD, OP_STORE}},
+    {OP_GINC, 4, {OP_GLOAD, OP_PUSH, OP_IADD, OP_GSTORE}},
+    {OP_LLIADD, 3, {OP_LOAD, OP_LOAD, OP_IADD}},
+    {OP_LKIADD, 3, {OP_LOAD, OP_PUSH, OP_IADD}},
+    {OP_LKISUB, 3, {OP_LOAD, OP_PUSH, OP_ISUB}},
+    {OP_ILTJMPF, 2, {OP_ILT, OP_JMPF}},
+    {OP_LDFIELD, 2, {OP_LDARG0, OP_GETFIELD}}
+};
+
+// Tries to fuse the sequence at @pc, returns true on success.
+// @target marks the instructions that are jumped to.
+bool bytecode_fuse_at(bytecode_t* bytecode, bool* target, size_t pc, const fusion_t* fusion) {
+    if(pc + fusion->len > bytecode->len) return false;
+
+    code_t* code = &bytecode->code[pc];
+    for(int i = 0; i < fusion->len; i++) {
+        if(code[i].op != fusion->ops[i]) return false;
+        if(i > 0 && target[pc+i]) return false;
+    }
+
+    // Pushed values must be integers, they become plain operands
+    int k = 0;
+    if(fusion->ops[1] == OP_PUSH) {
+        val_t val = bytecode->consts[code[1].a];
+        if(!IS_INT32(val)) return false;
+        k = AS_INT32(val);
+    }
+
+    code_t fused = {.op = fusion->fused, .a = code[0].a};
+    switch(fusion->fused) {
+        case OP_LKILTJMPF: fused.b = k; fused.c = code[3].a; break;
+        case OP_LINC:
+        case OP_GINC: {
+            // Must store into the loaded variable
+            if(code[3].a != code[0].a) return false;
+            fused.b = k;
+            break;
+        }
+        case OP_LLIADD: fused.b = code[1].a; break;
+        case OP_LKIADD:
+        case OP_LKISUB: fused.b = k; break;
+        case OP_ILTJMPF:
+        case OP_LDFIELD: fused.a = code[1].a; break;
+        default: return false;
+    }
+
+    code[0] = fused;
+    return true;
+}
+
+void bytecode_fuse(bytecode_t* bytecode) {
+    // Mark all jump targets, sequences must not be entered in the middle
+    bool* target = calloc(bytecode->len, sizeof(bool));
+    for(size_t i = 0; i < bytecode->len; i++) {
+        int* addr = bytecode_target(&bytecode->code[i]);
+        if(addr && *addr >= 0 && (size_t)*addr < bytecode->len) {
+            target[*addr] = true;
+        }
+    }
+
+    size_t num = sizeof(fusions) / sizeof(fusions[0]);
+    for(size_t i = 0; i < bytecode->len; i++) {
+        for(size_t j = 0; j < num; j++) {
+            if(bytecode_fuse_at(bytecode, target, i, &fusions[j])) {
+                i += fusions[j].len - 1;
+                break;
+            }
+        }
+    }
+    free(target);
+}
+
+void bytecode_free(bytecode_t* bytecode) {
+    if(bytecode) {
+        for(size_t i = 0; i < bytecode->num_consts; i++) {
+            val_free(bytecode->consts[i]);
+        }
+        free(bytecode->consts);
+        free(bytecode->code);
+        free(bytecode);
+    }
+}
+
 void bytecode_buffer_free(vector_t* buffer) {
     if(buffer) {
         for(size_t i = 0; i < vector_size(buffer); i++) {
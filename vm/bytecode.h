@@ -14,6 +14,17 @@
  *
  * Also the compiler-specific helper functions are defined below.
  * For instruction lists a vector_t should be used (see adt/vector.h).
+ *
+ * Before execution the list is packed into a flat array of code_t (bytecode_t).
+ * Operands of packed instructions are plain integers,
+ * generic values (push, ldlib) are moved into a constant table.
+ *
+ * code
+ * |- op
+ * |- h  <-- stack height set by register instructions (see regcode.h)
+ * |- a  <-- operand or constant index
+ * |- b
+ * |- c
  */
 
 #ifndef bytecode_h
@@ -117,7 +128,74 @@ typedef enum {
     // Class
     OP_CLASS,
     OP_SETFIELD,
-    OP_GETFIELD
+    OP_GETFIELD,
+
+    // Subscript (mutable variables)
+    OP_MSETSUB,
+    OP_MCONS,
+
+    // Superinstructions (see bytecode_fuse)
+    OP_LLIADD,
+    OP_LKIADD,
+    OP_LKISUB,
+    OP_LINC,
+    OP_GINC,
+    OP_ILTJMPF,
+    OP_LKILTJMPF,
+    OP_LDFIELD,
+
+    // Register instructions (see regcode.h)
+    OP_RMOV,
+    OP_RMOVG,
+    OP_RMOVK,
+    OP_RJMPF,
+    OP_RIADD,
+    OP_RISUB,
+    OP_RIMUL,
+    OP_RIDIV,
+    OP_RMOD,
+    OP_RIEQ,
+    OP_RINE,
+    OP_RILT,
+    OP_RIGT,
+    OP_RILE,
+    OP_RIGE,
+    OP_RIADDK,
+    OP_RISUBK,
+    OP_RIEQK,
+    OP_RINEK,
+    OP_RILTK,
+    OP_RIGTK,
+    OP_RILEK,
+    OP_RIGEK,
+    OP_RFADD,
+    OP_RFSUB,
+    OP_RFMUL,
+    OP_RFDIV,
+    OP_RFLT,
+    OP_RFGT,
+    OP_RFLE,
+    OP_RFGE,
+    OP_RRET,
+    OP_RIEQJ,
+    OP_RINEJ,
+    OP_RILTJ,
+    OP_RIGTJ,
+    OP_RILEJ,
+    OP_RIGEJ,
+    OP_RIEQKJ,
+    OP_RINEKJ,
+    OP_RILTKJ,
+    OP_RIGTKJ,
+    OP_RILEKJ,
+    OP_RIGEKJ,
+    OP_PUSHK,
+    OP_AGETSUB,
+    OP_SGETSUB,
+    OP_ALEN,
+    OP_SLEN,
+    OP_AAPPEND,
+    OP_SAPPEND
 } opcode_t;
 
 // Instruction definition
@@ -127,8 +205,35 @@ typedef struct {
     val_t v2;
 } instruction_t;
 
+// Packed instruction definition
+// The handler address and the resolved jump target are set by the vm before execution.
+typedef struct code_t {
+    void* handler;
+    struct code_t* target;
+    uint16_t op;
+    int16_t h;
+    int a;
+    int b;
+    int c;
+} code_t;
+
+// Packed bytecode, instructions and constants are stored contiguously
+typedef struct {
+    code_t* code;
+    size_t len;
+    val_t* consts;
+    size_t num_consts;
+} bytecode_t;
+
 // Helper functions
 const char* op2str(opcode_t code);
+int op_args(opcode_t code);
+
+/**
+ * Returns the operand of a packed instruction, that holds its jump address.
+ * Null, if the instruction does not jump.
+ */
+int* bytecode_target(code_t* code);
 
 /**
  * Insert one opcode and one or two values.
@@ -178,4 +283,18 @@ val_t* emit_jmpf(vector_t* buffer, int address);
  */
 void bytecode_buffer_free(vector_t* buffer);
 
+/**
+ * Packs a list of instructions into a bytecode_t.
+ * The buffer is consumed, its values are moved into the constant table.
+ */
+bytecode_t* bytecode_pack(vector_t* buffer);
+void bytecode_print(bytecode_t* bytecode, size_t pc);
+
+/**
+ * Replaces frequent instruction sequences with superinstructions.
+ * The code is not compacted, fused instructions skip the rest of their sequence.
+ */
+void bytecode_fuse(bytecode_t* bytecode);
+void bytecode_free(bytecode_t* bytecode);
+
 #endif
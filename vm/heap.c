@@ -0,0 +1,152 @@
+// Copyright (C) 2017 Alexander Koch
+#include "rawmem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "heap.h"
+
+// The page header and the slots have to fit into a page
+typedef char heap_page_fits[(sizeof(heap_page_t) <= HEAP_PAGE_SIZE) ? 1 : -1];
+
+// @pages All pages, new pages are inserted at the front
+// @avail Pages with free slots
+// @cursor Next page of the running sweep, @epoch Number of the sweep
+static struct {
+    heap_page_t* pages;
+    heap_page_t* avail;
+    heap_page_t* cursor;
+    unsigned int epoch;
+    bool sweeping;
+} heap;
+
+static void heap_avail_push(heap_page_t* page) {
+    page->avail = true;
+    page->prevAvail = 0;
+    page->nextAvail = heap.avail;
+    if(heap.avail) heap.avail->prevAvail = page;
+    heap.avail = page;
+}
+
+static void heap_avail_remove(heap_page_t* page) {
+    page->avail = false;
+    if(page->prevAvail) page->prevAvail->nextAvail = page->nextAvail;
+    else heap.avail = page->nextAvail;
+    if(page->nextAvail) page->nextAvail->prevAvail = page->prevAvail;
+}
+
+static heap_page_t* heap_page_new() {
+    void* mem = 0;
+    if(posix_memalign(&mem, HEAP_PAGE_SIZE, sizeof(heap_page_t))) {
+        fprintf(stderr, "Fatal error: Allocation of a heap page failed\n");
+        abort();
+    }
+
+    heap_page_t* page = mem;
+    memset(page, 0, offsetof(heap_page_t, slots));
+    for(int i = HEAP_SLOTS - 1; i >= 0; i--) {
+        page->slots[i].data = page->free;
+        page->free = &page->slots[i];
+    }
+
+    // Nothing to sweep in a new page
+    page->swept = heap.epoch;
+    page->next = heap.pages;
+    if(heap.pages) heap.pages->prev = page;
+    heap.pages = page;
+    heap_avail_push(page);
+    return page;
+}
+
+static void heap_page_release(heap_page_t* page) {
+    if(page->avail) heap_avail_remove(page);
+    if(page->prev) page->prev->next = page->next;
+    else heap.pages = page->next;
+    if(page->next) page->next->prev = page->prev;
+    free(page);
+}
+
+obj_t* heap_alloc() {
+    heap_page_t* page = heap.avail ? heap.avail : heap_page_new();
+    obj_t* obj = page->free;
+    page->free = obj->data;
+    if(!page->free) heap_avail_remove(page);
+
+    size_t slot = obj - page->slots;
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    page->used[slot / 64] |= bit;
+    page->old[slot / 64] &= ~bit;
+    page->mark[slot / 64] &= ~bit;
+    page->numUsed++;
+    return obj;
+}
+
+void heap_free(obj_t* obj) {
+    heap_page_t* page = heap_page(obj);
+    size_t slot = heap_slot(obj);
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    page->used[slot / 64] &= ~bit;
+    page->old[slot / 64] &= ~bit;
+    page->mark[slot / 64] &= ~bit;
+    page->numUsed--;
+
+    obj->data = page->free;
+    page->free = obj;
+    if(!page->avail) heap_avail_push(page);
+}
+
+void heap_sweep_start() {
+    heap.epoch++;
+    heap.cursor = heap.pages;
+    heap.sweeping = heap.cursor != 0;
+}
+
+bool heap_sweeping() {
+    return heap.sweeping;
+}
+
+size_t heap_sweep_page() {
+    heap_page_t* page = heap.cursor;
+    if(!page) {
+        heap.sweeping = false;
+        return 0;
+    }
+    heap.cursor = page->next;
+    heap.sweeping = heap.cursor != 0;
+    page->swept = heap.epoch;
+
+    // Objects are freed by obj_free, it frees the data first
+    size_t freed = 0;
+    for(int i = 0; i < HEAP_WORDS; i++) {
+        uint64_t dead = page->old[i] & ~page->mark[i];
+        while(dead) {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            obj_free(&page->slots[i * 64 + bit]);
+            freed++;
+        }
+    }
+    memset(page->mark, 0, sizeof(page->mark));
+
+    if(page->numUsed == 0 && (page->prev || page->next)) {
+        heap_page_release(page);
+    }
+    return freed;
+}
+
+bool heap_unswept(obj_t* obj) {
+    return heap.sweeping && heap_page(obj)->swept != heap.epoch;
+}
+
+void heap_each(void (*visit)(obj_t* obj)) {
+    for(heap_page_t* page = heap.pages; page; page = page->next) {
+        for(int i = 0; i < HEAP_WORDS; i++) {
+            uint64_t used = page->used[i];
+            while(used) {
+                int bit = __builtin_ctzll(used);
+                used &= used - 1;
+                visit(&page->slots[i * 64 + bit]);
+            }
+        }
+    }
+}
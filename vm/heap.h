@@ -0,0 +1,92 @@
+/**
+ * heap.h
+ * Copyright (C) 2017 Alexander Koch
+ * Page heap of the object headers
+ *
+ * Objects (obj_t) are allocated in pages of HEAP_PAGE_SIZE bytes, that are aligned to their size,
+ * so the page of an object is found by masking its address. Every page has side bitmaps:
+ * @used slots, @old objects (promoted by the collector, see vm_gc_minor) and @mark bits.
+ * Marking does not write to the objects, sweeping a page scans its bitmaps:
+ * old objects, that are not marked, are freed.
+ * Pages are swept one at a time (see heap_sweep_page), empty pages are released by the sweep.
+ */
+
+#ifndef heap_h
+#define heap_h
+
+#include <vm/val.h>
+
+#define HEAP_PAGE_SIZE 65536
+// 64 slots per bitmap word
+#define HEAP_WORDS 40
+#define HEAP_SLOTS (HEAP_WORDS * 64)
+
+// @free Free slots of the page, linked by their data pointer
+// @avail The page is in the list of pages with free slots
+// @swept Sweep, that has swept the page last (see heap_unswept)
+typedef struct heap_page_t {
+    uint64_t used[HEAP_WORDS];
+    uint64_t old[HEAP_WORDS];
+    uint64_t mark[HEAP_WORDS];
+    struct heap_page_t* prev;
+    struct heap_page_t* next;
+    struct heap_page_t* prevAvail;
+    struct heap_page_t* nextAvail;
+    obj_t* free;
+    int numUsed;
+    unsigned int swept;
+    bool avail;
+    obj_t slots[HEAP_SLOTS];
+} heap_page_t;
+
+obj_t* heap_alloc();
+void heap_free(obj_t* obj);
+
+// Starts a sweep of all pages, pages created from now on are not swept
+void heap_sweep_start();
+bool heap_sweeping();
+// Sweeps the next page and clears its marks, returns the number of freed objects
+size_t heap_sweep_page();
+// The page of the object has not been swept by the running sweep
+bool heap_unswept(obj_t* obj);
+// Calls @visit with every allocated object
+void heap_each(void (*visit)(obj_t* obj));
+
+static inline heap_page_t* heap_page(obj_t* obj) {
+    return (heap_page_t*)((uintptr_t)obj & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t heap_slot(obj_t* obj) {
+    return obj - heap_page(obj)->slots;
+}
+
+#define HEAP_WORD(bits, obj) (heap_page(obj)->bits[heap_slot(obj) / 64])
+#define HEAP_BIT(obj) ((uint64_t)1 << (heap_slot(obj) % 64))
+
+static inline bool heap_marked(obj_t* obj) {
+    return (HEAP_WORD(mark, obj) & HEAP_BIT(obj)) != 0;
+}
+
+static inline void heap_mark(obj_t* obj) {
+    HEAP_WORD(mark, obj) |= HEAP_BIT(obj);
+}
+
+static inline void heap_unmark(obj_t* obj) {
+    HEAP_WORD(mark, obj) &= ~HEAP_BIT(obj);
+}
+
+#ifdef __GNUC__
+// Marks the object from several threads, returns true if it was not marked before
+static inline bool heap_mark_atomic(obj_t* obj) {
+    uint64_t bit = HEAP_BIT(obj);
+    uint64_t* word = &HEAP_WORD(mark, obj);
+    if(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return false;
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+#endif
+
+static inline void heap_set_old(obj_t* obj) {
+    HEAP_WORD(old, obj) |= HEAP_BIT(obj);
+}
+
+#endif
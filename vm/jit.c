@@ -0,0 +1,1636 @@
+// Copyright (C) 2017 Alexander Koch
+// mmap flags are not part of c99
+#define _DEFAULT_SOURCE
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+// Compilation state of a function or a loop
+typedef enum {
+    JIT_NONE,
+    JIT_BUSY,
+    JIT_DONE,
+    JIT_FAILED
+} jit_state_t;
+
+// @calls Call counter of every function entry
+// @native Native code of the compiled functions, @size is the size of its mapping
+// Instruction of a recorded trace
+// @obj The slot of a load or store holds an object, an object is freed by reserve
+// @taken The conditional jump is taken
+typedef struct {
+    code_t* instr;
+    bool obj;
+    bool taken;
+} jit_step_t;
+
+// @calls Call counter of every function entry
+// @native Native code of the compiled functions, @size is the size of its mapping
+// @escape Return point of jit_call and jit_trace_call for exceptions
+// @loops Back edge counter of every loop header
+// @traces Native traces of the loops, @trace_size is the size of its mapping
+// @header Loop that is recorded (-1 if none), its instructions are collected in @steps
+// @handlers Handlers of the instructions, while they are replaced by @record
+// @record_sp Stack height at the loop header
+struct jit_t {
+    bytecode_t* bytecode;
+    int* calls;
+    jit_state_t* state;
+    jit_fn_t* native;
+    size_t* size;
+    jmp_buf escape;
+
+    int* loops;
+    jit_state_t* loop_state;
+    jit_trace_fn_t* traces;
+    size_t* trace_size;
+
+    int header;
+    jit_step_t* steps;
+    size_t num_steps;
+    void** handlers;
+    void* record;
+    int record_sp;
+};
+
+// Machine code buffer
+// @offset Native offset of every instruction (-1 if not compiled)
+// @patch Positions of jump displacements and their target instructions
+typedef struct {
+    uint8_t* buf;
+    size_t len;
+    size_t cap;
+    int* offset;
+    int* patch;
+    size_t num_patches;
+} jit_code_t;
+
+// Registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define R12 12
+#define R13 13
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R9 9
+#define R10 10
+#define R11 11
+#define R14 14
+#define R15 15
+#define XMM0 0
+#define XMM1 1
+
+// Integers are stored in the lower 32 bits (see val_of_int32),
+// the templates and the frame helpers use this directly.
+#define JIT_INT32_VAL(i) ((val_t)(uint32_t)(i))
+#define JIT_AS_INT32(v) ((int32_t)(uint32_t)(v))
+
+// Register holding the stack pointer, the frame pointer and the vm
+#define SP RBX
+#define FP R12
+#define VM R13
+
+jit_t* jit_new() {
+    return calloc(1, sizeof(jit_t));
+}
+
+void jit_load(jit_t* jit, bytecode_t* bytecode) {
+    size_t len = bytecode->len;
+    jit->bytecode = bytecode;
+    jit->calls = calloc(len, sizeof(int));
+    jit->state = calloc(len, sizeof(jit_state_t));
+    jit->native = calloc(len, sizeof(jit_fn_t));
+    jit->size = calloc(len, sizeof(size_t));
+
+    jit->loops = calloc(len, sizeof(int));
+    jit->loop_state = calloc(len, sizeof(jit_state_t));
+    jit->traces = calloc(len, sizeof(jit_trace_fn_t));
+    jit->trace_size = calloc(len, sizeof(size_t));
+    jit->header = -1;
+    jit->steps = malloc(sizeof(jit_step_t) * JIT_TRACE_LENGTH);
+    jit->handlers = malloc(sizeof(void*) * len);
+}
+
+// Helper functions, called by the native code.
+// They work like the handlers of vm_exec and return the new stack pointer.
+
+val_t* jit_store(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    vm_store(&fp[instr->a], sp[-1]);
+    return sp - 1;
+}
+
+val_t* jit_gstore(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    vm_store(&vm->stack[instr->a], sp[-1]);
+    return sp - 1;
+}
+
+val_t* jit_ldarg0(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    int args = AS_INT32(fp[-3]);
+    *sp++ = fp[-args-4];
+    return sp;
+}
+
+val_t* jit_setarg0(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    int args = AS_INT32(fp[-3]);
+    vm_store(&fp[-args-4], sp[-1]);
+    return sp - 1;
+}
+
+val_t* jit_feq(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    bool result = AS_NUM(sp[-2]) == AS_NUM(sp[-1]);
+    if(instr->op == OP_FNE) result = !result;
+    sp[-2] = BOOL_VAL(result);
+    return sp - 1;
+}
+
+val_t* jit_getsub(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    int idx = AS_INT32(sp[-1]);
+    val_t obj = sp[-2];
+    if(IS_STRING(obj)) {
+        sp[-2] = INT32_VAL(AS_STRING(obj)[idx]);
+    } else {
+        sp[-2] = AS_ARRAY(obj)->data[idx];
+    }
+    return sp - 1;
+}
+
+val_t* jit_len(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    val_t obj = sp[-1];
+    if(IS_STRING(obj)) {
+        sp[-1] = INT32_VAL(strlen(AS_STRING(obj)));
+    } else {
+        sp[-1] = INT32_VAL(AS_ARRAY(obj)->len);
+    }
+    return sp;
+}
+
+val_t* jit_syscall(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    // Natives and the collector use the vm registers.
+    // Exceptions move the program counter to the error handler (see vm_throw).
+    int pc = instr - vm->jit->bytecode->code + 1;
+    vm->pc = pc;
+    vm->sp = sp - vm->stack;
+    vm->fp = fp - vm->stack;
+    vm_syscall(vm, instr->a);
+    if(vm->pc != pc) {
+        longjmp(vm->jit->escape, 1);
+    }
+    return vm->stack + vm->sp;
+}
+
+val_t* jit_tostr(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    val_t str = STRING_NOCOPY_VAL(val_tostr(sp[-1]));
+    vm->sp = sp - 1 - vm->stack;
+    vm_register(vm, str);
+    return sp;
+}
+
+val_t* jit_sappend(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    // String concatenation (see code_sappend)
+    char* str1 = AS_STRING(sp[-2]);
+    char* str2 = AS_STRING(sp[-1]);
+    size_t len1 = strlen(str1);
+    size_t len2 = strlen(str2);
+    obj_t* obj = obj_string_buffer_new(len1 + len2);
+    memcpy(obj->data, str1, len1);
+    memcpy((char*)obj->data + len1, str2, len2 + 1);
+
+    vm->sp = sp - 2 - vm->stack;
+    vm_register(vm, OBJ_VAL(obj));
+    return sp - 1;
+}
+
+val_t* jit_reserve(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    // New variables are cleared, freed ones lose their value
+    int sz = instr->a;
+    if(sz > 0) {
+        for(int i = 0; i < sz; i++) {
+            sp[i] = NULL_VAL;
+        }
+    } else {
+        for(int i = sz; i < 0; i++) {
+            RELEASE_VAL(sp[i]);
+        }
+    }
+    sp += sz;
+    vm->lp = sp - vm->stack;
+    return sp;
+}
+
+val_t* jit_invoke(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    jit_t* jit = vm->jit;
+    val_t* stack = vm->stack;
+
+    // Same frame layout as the interpreter (see code_invoke)
+    if(sp + 3 + instr->c > stack + STACK_SIZE) {
+        vm->pc = instr - jit->bytecode->code;
+        vm->sp = sp - stack;
+        vm->fp = fp - stack;
+        vm_throw(vm, "Stack overflow");
+        longjmp(jit->escape, 1);
+    }
+
+    for(val_t* v = stack + vm->lp; v < sp; v++) {
+        RETAIN_VAL(*v);
+    }
+    vm->frames[vm->depth++] = vm->lp;
+
+    *sp++ = JIT_INT32_VAL(instr->b);
+    *sp++ = JIT_INT32_VAL(fp - stack);
+    *sp++ = JIT_INT32_VAL(instr - jit->bytecode->code + 1);
+    vm->lp = sp - stack;
+    vm->bases[vm->depth - 1] = vm->lp;
+    return jit->native[instr->a](vm, sp);
+}
+
+val_t* jit_ret(vm_t* vm, val_t* sp, val_t* fp, code_t* instr) {
+    // Removes the frame and pushes the return value (see LEAVE)
+    val_t ret = *--sp;
+    for(val_t* v = fp; v < sp; v++) {
+        RELEASE_VAL(*v);
+    }
+
+    int args = JIT_AS_INT32(fp[-3]);
+    sp = fp - 3;
+    vm->lp = vm->frames[--vm->depth];
+    for(val_t* v = vm->stack + vm->lp; v < sp; v++) {
+        RELEASE_VAL(*v);
+    }
+    sp -= args;
+    *sp++ = ret;
+    return sp;
+}
+
+// Machine code emission
+
+void jit_byte(jit_code_t* j, uint8_t b) {
+    if(j->len >= j->cap) {
+        j->cap = (j->cap < 256) ? 256 : j->cap * 2;
+        j->buf = realloc(j->buf, j->cap);
+    }
+    j->buf[j->len++] = b;
+}
+
+void jit_bytes(jit_code_t* j, const char* bytes, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        jit_byte(j, (uint8_t)bytes[i]);
+    }
+}
+
+void jit_int32(jit_code_t* j, int32_t v) {
+    uint32_t u = (uint32_t)v;
+    for(int i = 0; i < 4; i++) {
+        jit_byte(j, (u >> (i * 8)) & 0xff);
+    }
+}
+
+void jit_int64(jit_code_t* j, uint64_t v) {
+    for(int i = 0; i < 8; i++) {
+        jit_byte(j, (v >> (i * 8)) & 0xff);
+    }
+}
+
+// Instruction with a memory operand [base + disp32]
+// @prefix Mandatory prefix of sse instructions (0 if none)
+// @w 64-bit operand size
+// @reg Register operand or opcode extension
+void jit_mem(jit_code_t* j, uint8_t prefix, bool w, const char* op, size_t oplen, int reg, int base, int disp) {
+    if(prefix) jit_byte(j, prefix);
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if(rex != 0x40) jit_byte(j, rex);
+    jit_bytes(j, op, oplen);
+    jit_byte(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if((base & 7) == 4) jit_byte(j, 0x24);
+    jit_int32(j, disp);
+}
+
+#define JIT_MEM(j, prefix, w, op, reg, base, disp) \
+    jit_mem(j, prefix, w, op, sizeof(op) - 1, reg, base, disp)
+
+// mov reg, [base + disp] / mov [base + disp], reg
+#define LOAD64(j, reg, base, disp) JIT_MEM(j, 0, true, "\x8b", reg, base, disp)
+#define STORE64(j, reg, base, disp) JIT_MEM(j, 0, true, "\x89", reg, base, disp)
+#define LOAD32(j, reg, base, disp) JIT_MEM(j, 0, false, "\x8b", reg, base, disp)
+
+// Stack slots relative to sp
+#define TOP(i) (-8 * (i))
+
+// lea rbx, [rbx + 8 * n]
+void jit_move_sp(jit_code_t* j, int n) {
+    JIT_MEM(j, 0, true, "\x8d", SP, SP, 8 * n);
+}
+
+// mov reg, imm64
+void jit_imm64(jit_code_t* j, int reg, uint64_t v) {
+    jit_byte(j, 0x48);
+    jit_byte(j, 0xb8 + reg);
+    jit_int64(j, v);
+}
+
+// Pushes rax
+void jit_push_rax(jit_code_t* j) {
+    STORE64(j, RAX, SP, 0);
+    jit_move_sp(j, 1);
+}
+
+// Converts the flag of setcc into a bool value and replaces the operands
+void jit_setcc(jit_code_t* j, uint8_t cc) {
+    jit_bytes(j, "\x0f", 1);
+    jit_byte(j, cc);
+    jit_bytes(j, "\xc0\x0f\xb6\xc0", 4);  // setcc al; movzx eax, al
+    jit_imm64(j, RCX, FALSE_VAL);
+    jit_bytes(j, "\x48\x01\xc8", 3);      // add rax, rcx
+    STORE64(j, RAX, SP, TOP(2));
+    jit_move_sp(j, -1);
+}
+
+// Calls a helper, the stack pointer is updated with the result
+void jit_helper(jit_code_t* j, void* fn, code_t* instr) {
+    jit_bytes(j, "\x4c\x89\xef", 3);      // mov rdi, r13
+    jit_bytes(j, "\x48\x89\xde", 3);      // mov rsi, rbx
+    jit_bytes(j, "\x4c\x89\xe2", 3);      // mov rdx, r12
+    jit_imm64(j, RCX, (uint64_t)(uintptr_t)instr);
+    jit_imm64(j, RAX, (uint64_t)(uintptr_t)fn);
+    jit_bytes(j, "\xff\xd0", 2);          // call rax
+    jit_bytes(j, "\x48\x89\xc3", 3);      // mov rbx, rax
+}
+
+// Jump with a rel32 displacement to the instruction @target
+// @op Opcode bytes (jmp or jcc)
+void jit_jump(jit_code_t* j, const char* op, size_t oplen, int target) {
+    jit_bytes(j, op, oplen);
+    j->patch[j->num_patches * 2] = j->len;
+    j->patch[j->num_patches * 2 + 1] = target;
+    j->num_patches++;
+    jit_int32(j, 0);
+}
+
+#define JMP(j, target) jit_jump(j, "\xe9", 1, target)
+#define JCC(j, cc, target) jit_jump(j, cc, 2, target)
+
+void jit_epilogue(jit_code_t* j) {
+    jit_bytes(j, "\x48\x89\xd8", 3);      // mov rax, rbx
+    jit_bytes(j, "\x41\x5d\x41\x5c\x5b\xc3", 6); // pop r13; pop r12; pop rbx; ret
+}
+
+// Integer operation on the two top values: mov eax, a; op eax, b; mov a, rax
+void jit_int_binary(jit_code_t* j, const char* op, size_t oplen) {
+    LOAD32(j, RAX, SP, TOP(2));
+    jit_mem(j, 0, false, op, oplen, RAX, SP, TOP(1));
+    STORE64(j, RAX, SP, TOP(2));
+    jit_move_sp(j, -1);
+}
+
+// Float comparison, @swap compares b with a
+void jit_float_compare(jit_code_t* j, bool swap, uint8_t cc) {
+    JIT_MEM(j, 0xf2, false, "\x0f\x10", XMM0, SP, swap ? TOP(1) : TOP(2));
+    JIT_MEM(j, 0x66, false, "\x0f\x2e", XMM0, SP, swap ? TOP(2) : TOP(1));
+    jit_setcc(j, cc);
+}
+
+// Instruction after @pc, if the condition of a branch is true / no jump is taken
+int jit_next(code_t* code, int pc) {
+    switch(code->op) {
+        case OP_LLIADD:
+        case OP_LKIADD:
+        case OP_LKISUB: return pc + 3;
+        case OP_LINC:
+        case OP_GINC:
+        case OP_LKILTJMPF: return pc + 4;
+        case OP_ILTJMPF: return pc + 2;
+        case OP_RET:
+        case OP_JMP: return -1;
+        default: return pc + 1;
+    }
+}
+
+bool jit_supported(opcode_t op) {
+    switch(op) {
+        case OP_PUSH:
+        case OP_PUSHK:
+        case OP_POP:
+        case OP_STORE:
+        case OP_LOAD:
+        case OP_GSTORE:
+        case OP_GLOAD:
+        case OP_LDARG0:
+        case OP_SETARG0:
+        case OP_SYSCALL:
+        case OP_INVOKE:
+        case OP_RESERVE:
+        case OP_RET:
+        case OP_JMP:
+        case OP_JMPF:
+        case OP_GETSUB:
+        case OP_AGETSUB:
+        case OP_SGETSUB:
+        case OP_LEN:
+        case OP_ALEN:
+        case OP_SLEN:
+        case OP_LLIADD:
+        case OP_LKIADD:
+        case OP_LKISUB:
+        case OP_LINC:
+        case OP_GINC:
+        case OP_ILTJMPF:
+        case OP_LKILTJMPF: return true;
+        default: {
+            if(op >= OP_IADD && op <= OP_B2I) return true;
+            if(op >= OP_BEQ && op <= OP_BOR) return true;
+            return false;
+        }
+    }
+}
+
+// Emits the template of an instruction
+void jit_emit(jit_code_t* j, bytecode_t* bytecode, int pc) {
+    code_t* instr = &bytecode->code[pc];
+    switch(instr->op) {
+        case OP_PUSH:
+        case OP_PUSHK: {
+            // Constant objects are pinned (see code_push)
+            val_t val = bytecode->consts[instr->a];
+            if(instr->op == OP_PUSH) RETAIN_VAL(val);
+            jit_imm64(j, RAX, val);
+            jit_push_rax(j);
+            break;
+        }
+        case OP_POP: jit_move_sp(j, -1); break;
+        case OP_LOAD: {
+            LOAD64(j, RAX, FP, 8 * instr->a);
+            jit_push_rax(j);
+            break;
+        }
+        case OP_GLOAD: {
+            LOAD64(j, RAX, VM, offsetof(vm_t, stack) + 8 * instr->a);
+            jit_push_rax(j);
+            break;
+        }
+        case OP_STORE: jit_helper(j, jit_store, instr); break;
+        case OP_GSTORE: jit_helper(j, jit_gstore, instr); break;
+        case OP_LDARG0: jit_helper(j, jit_ldarg0, instr); break;
+        case OP_SETARG0: jit_helper(j, jit_setarg0, instr); break;
+        case OP_SYSCALL: jit_helper(j, jit_syscall, instr); break;
+        case OP_RESERVE: jit_helper(j, jit_reserve, instr); break;
+        case OP_INVOKE: jit_helper(j, jit_invoke, instr); break;
+        case OP_GETSUB:
+        case OP_AGETSUB:
+        case OP_SGETSUB: jit_helper(j, jit_getsub, instr); break;
+        case OP_LEN:
+        case OP_ALEN:
+        case OP_SLEN: jit_helper(j, jit_len, instr); break;
+        case OP_FEQ:
+        case OP_FNE: jit_helper(j, jit_feq, instr); break;
+        case OP_RET: {
+            jit_helper(j, jit_ret, instr);
+            jit_epilogue(j);
+            break;
+        }
+        case OP_JMP: JMP(j, instr->a); break;
+        case OP_JMPF: {
+            LOAD64(j, RAX, SP, TOP(1));
+            jit_move_sp(j, -1);
+            jit_imm64(j, RCX, TRUE_VAL);
+            jit_bytes(j, "\x48\x39\xc8", 3);  // cmp rax, rcx
+            JCC(j, "\x0f\x85", instr->a);      // jne
+            break;
+        }
+
+        // Integers
+        case OP_IADD: jit_int_binary(j, "\x03", 1); break;
+        case OP_ISUB: jit_int_binary(j, "\x2b", 1); break;
+        case OP_IMUL: jit_int_binary(j, "\x0f\xaf", 2); break;
+        case OP_BITAND: jit_int_binary(j, "\x23", 1); break;
+        case OP_BITOR: jit_int_binary(j, "\x0b", 1); break;
+        case OP_BITXOR: jit_int_binary(j, "\x33", 1); break;
+        case OP_IDIV:
+        case OP_MOD: {
+            LOAD32(j, RAX, SP, TOP(2));
+            jit_byte(j, 0x99);                // cdq
+            JIT_MEM(j, 0, false, "\xf7", 7, SP, TOP(1)); // idiv
+            if(instr->op == OP_MOD) jit_bytes(j, "\x89\xd0", 2); // mov eax, edx
+            STORE64(j, RAX, SP, TOP(2));
+            jit_move_sp(j, -1);
+            break;
+        }
+        case OP_BITL:
+        case OP_BITR: {
+            LOAD32(j, RCX, SP, TOP(1));
+            LOAD32(j, RAX, SP, TOP(2));
+            jit_bytes(j, instr->op == OP_BITL ? "\xd3\xe0" : "\xd3\xf8", 2); // shl / sar eax, cl
+            STORE64(j, RAX, SP, TOP(2));
+            jit_move_sp(j, -1);
+            break;
+        }
+        case OP_BITNOT:
+        case OP_IMINUS: {
+            LOAD32(j, RAX, SP, TOP(1));
+            jit_bytes(j, instr->op == OP_BITNOT ? "\xf7\xd0" : "\xf7\xd8", 2); // not / neg eax
+            STORE64(j, RAX, SP, TOP(1));
+            break;
+        }
+        case OP_I2F: {
+            JIT_MEM(j, 0xf2, false, "\x0f\x2a", XMM0, SP, TOP(1)); // cvtsi2sd xmm0, dword
+            JIT_MEM(j, 0xf2, false, "\x0f\x11", XMM0, SP, TOP(1));
+            break;
+        }
+        case OP_IEQ:
+        case OP_INE:
+        case OP_ILT:
+        case OP_IGT:
+        case OP_ILE:
+        case OP_IGE: {
+            static const uint8_t cc[] = {0x94, 0x95, 0x9c, 0x9f, 0x9e, 0x9d};
+            int index = (instr->op == OP_IEQ) ? 0 : (instr->op == OP_INE) ? 1 : 2 + instr->op - OP_ILT;
+            LOAD32(j, RAX, SP, TOP(2));
+            JIT_MEM(j, 0, false, "\x3b", RAX, SP, TOP(1)); // cmp eax, b
+            jit_setcc(j, cc[index]);
+            break;
+        }
+
+        // Floats
+        case OP_FADD:
+        case OP_FSUB:
+        case OP_FMUL:
+        case OP_FDIV: {
+            static const char* ops[] = {"\x0f\x58", "\x0f\x5c", "\x0f\x59", "\x0f\x5e"};
+            JIT_MEM(j, 0xf2, false, "\x0f\x10", XMM0, SP, TOP(2));
+            jit_mem(j, 0xf2, false, ops[instr->op - OP_FADD], 2, XMM0, SP, TOP(1));
+            JIT_MEM(j, 0xf2, false, "\x0f\x11", XMM0, SP, TOP(2));
+            jit_move_sp(j, -1);
+            break;
+        }
+        case OP_FMINUS: {
+            LOAD64(j, RAX, SP, TOP(1));
+            jit_bytes(j, "\x48\x0f\xba\xf8\x3f", 5); // btc rax, 63
+            STORE64(j, RAX, SP, TOP(1));
+            break;
+        }
+        case OP_F2I: {
+            JIT_MEM(j, 0xf2, false, "\x0f\x2c", RAX, SP, TOP(1)); // cvttsd2si eax
+            STORE64(j, RAX, SP, TOP(1));
+            break;
+        }
+        // Unordered (NaN) compares as false, like in C
+        case OP_FLT: jit_float_compare(j, true, 0x97); break;
+        case OP_FGT: jit_float_compare(j, false, 0x97); break;
+        case OP_FLE: jit_float_compare(j, true, 0x93); break;
+        case OP_FGE: jit_float_compare(j, false, 0x93); break;
+
+        // Bools, true and false only differ in the lowest bit
+        case OP_NOT: {
+            LOAD64(j, RAX, SP, TOP(1));
+            jit_bytes(j, "\x48\x83\xf0\x01", 4); // xor rax, 1
+            STORE64(j, RAX, SP, TOP(1));
+            break;
+        }
+        case OP_B2I: {
+            LOAD32(j, RAX, SP, TOP(1));
+            jit_bytes(j, "\x83\xe0\x01", 3);     // and eax, 1
+            STORE64(j, RAX, SP, TOP(1));
+            break;
+        }
+        case OP_BEQ:
+        case OP_BNE: {
+            LOAD64(j, RAX, SP, TOP(2));
+            JIT_MEM(j, 0, true, "\x3b", RAX, SP, TOP(1)); // cmp rax, b
+            jit_setcc(j, instr->op == OP_BEQ ? 0x94 : 0x95);
+            break;
+        }
+        case OP_BAND:
+        case OP_BOR: {
+            LOAD64(j, RAX, SP, TOP(2));
+            jit_mem(j, 0, true, instr->op == OP_BAND ? "\x23" : "\x0b", 1, RAX, SP, TOP(1));
+            STORE64(j, RAX, SP, TOP(2));
+            jit_move_sp(j, -1);
+            break;
+        }
+
+        // Superinstructions
+        case OP_LLIADD: {
+            LOAD32(j, RAX, FP, 8 * instr->a);
+            JIT_MEM(j, 0, false, "\x03", RAX, FP, 8 * instr->b);
+            jit_push_rax(j);
+            break;
+        }
+        case OP_LKIADD:
+        case OP_LKISUB: {
+            LOAD32(j, RAX, FP, 8 * instr->a);
+            jit_byte(j, instr->op == OP_LKIADD ? 0x05 : 0x2d); // add / sub eax, imm32
+            jit_int32(j, instr->b);
+            jit_push_rax(j);
+            break;
+        }
+        case OP_LINC:
+        case OP_GINC: {
+            int base = (instr->op == OP_LINC) ? FP : VM;
+            int disp = 8 * instr->a + ((instr->op == OP_LINC) ? 0 : offsetof(vm_t, stack));
+            LOAD32(j, RAX, base, disp);
+            jit_byte(j, 0x05);                // add eax, imm32
+            jit_int32(j, instr->b);
+            STORE64(j, RAX, base, disp);
+            break;
+        }
+        case OP_ILTJMPF: {
+            LOAD32(j, RAX, SP, TOP(2));
+            JIT_MEM(j, 0, false, "\x3b", RAX, SP, TOP(1));
+            jit_move_sp(j, -2);
+            JCC(j, "\x0f\x8d", instr->a);      // jge
+            break;
+        }
+        case OP_LKILTJMPF: {
+            LOAD32(j, RAX, FP, 8 * instr->a);
+            jit_byte(j, 0x3d);                // cmp eax, imm32
+            jit_int32(j, instr->b);
+            JCC(j, "\x0f\x8d", instr->c);      // jge
+            break;
+        }
+        default: break;
+    }
+}
+
+bool jit_compile(jit_t* jit, int entry);
+
+// Collects the instructions of the function and compiles the functions it calls.
+// Returns false, if an instruction is not supported.
+bool jit_reach(jit_t* jit, int entry, bool* reached) {
+    bytecode_t* bytecode = jit->bytecode;
+    size_t len = bytecode->len;
+    int* work = malloc(sizeof(int) * len);
+    size_t top = 0;
+    bool valid = true;
+
+    reached[entry] = true;
+    work[top++] = entry;
+    while(top > 0 && valid) {
+        int pc = work[--top];
+        code_t* code = &bytecode->code[pc];
+        if(!jit_supported(code->op)) {
+            valid = false;
+            break;
+        }
+
+        // Calls are compiled first, recursion is only possible for the function itself
+        if(code->op == OP_INVOKE && code->a != entry) {
+            jit_state_t state = jit->state[code->a];
+            if(state == JIT_NONE) {
+                valid = jit_compile(jit, code->a);
+            } else {
+                valid = (state == JIT_DONE);
+            }
+        }
+
+        int next[2];
+        int count = 0;
+        int* target = bytecode_target(code);
+        if(target && code->op != OP_INVOKE) next[count++] = *target;
+        if(jit_next(code, pc) != -1) next[count++] = jit_next(code, pc);
+        for(int i = 0; i < count; i++) {
+            if(next[i] < 0 || (size_t)next[i] >= len) {
+                valid = false;
+            } else if(!reached[next[i]]) {
+                reached[next[i]] = true;
+                work[top++] = next[i];
+            }
+        }
+    }
+
+    free(work);
+    return valid;
+}
+
+bool jit_compile(jit_t* jit, int entry) {
+    bytecode_t* bytecode = jit->bytecode;
+    size_t len = bytecode->len;
+    jit->state[entry] = JIT_BUSY;
+
+    bool* reached = calloc(len, sizeof(bool));
+    if(!jit_reach(jit, entry, reached)) {
+        free(reached);
+        jit->state[entry] = JIT_FAILED;
+        return false;
+    }
+
+    jit_code_t j = {0};
+    j.offset = malloc(sizeof(int) * len);
+    j.patch = malloc(sizeof(int) * (len * 4 + 2));
+
+    // Prologue: push rbx; push r12; push r13; mov r13, rdi; mov rbx, rsi; mov r12, rsi
+    jit_bytes(&j, "\x53\x41\x54\x41\x55", 5);
+    jit_bytes(&j, "\x49\x89\xfd\x48\x89\xf3\x49\x89\xf4", 9);
+    JMP(&j, entry);
+
+    // Instructions in code order, fall through is kept by jumps
+    for(size_t pc = 0; pc < len; pc++) {
+        j.offset[pc] = -1;
+    }
+    for(size_t pc = 0; pc < len; pc++) {
+        if(!reached[pc]) continue;
+        j.offset[pc] = j.len;
+        jit_emit(&j, bytecode, pc);
+
+        int next = jit_next(&bytecode->code[pc], pc);
+        size_t following = pc + 1;
+        while(following < len && !reached[following]) following++;
+        if(next != -1 && (size_t)next != following) {
+            JMP(&j, next);
+        }
+    }
+
+    for(size_t i = 0; i < j.num_patches; i++) {
+        int pos = j.patch[i * 2];
+        int32_t rel = j.offset[j.patch[i * 2 + 1]] - (pos + 4);
+        memcpy(&j.buf[pos], &rel, sizeof(rel));
+    }
+
+    // Executable mapping
+    void* mem = mmap(0, j.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool valid = (mem != MAP_FAILED);
+    if(valid) {
+        memcpy(mem, j.buf, j.len);
+        valid = mprotect(mem, j.len, PROT_READ | PROT_EXEC) == 0;
+        if(valid) {
+            jit->native[entry] = (jit_fn_t)mem;
+            jit->size[entry] = j.len;
+        } else {
+            munmap(mem, j.len);
+        }
+    }
+
+    free(j.buf);
+    free(j.offset);
+    free(j.patch);
+    free(reached);
+    jit->state[entry] = valid ? JIT_DONE : JIT_FAILED;
+    return valid;
+}
+
+jit_fn_t jit_enter(jit_t* jit, int entry) {
+    if(jit->state[entry] == JIT_DONE) return jit->native[entry];
+    if(jit->state[entry] == JIT_NONE && ++jit->calls[entry] >= JIT_THRESHOLD) {
+        if(jit_compile(jit, entry)) return jit->native[entry];
+    }
+    return 0;
+}
+
+val_t* jit_call(vm_t* vm, jit_fn_t fn, val_t* fp) {
+    if(setjmp(vm->jit->escape)) {
+        return 0;
+    }
+    return fn(vm, fp);
+}
+
+// Tracing JIT
+//
+// Loops are recorded, while the interpreter executes one iteration.
+// The recorded path is compiled into a linear native loop, values of the operand stack
+// are kept unboxed in registers (integers in general purpose registers, doubles in sse registers).
+// Variables are written through to the vm stack, so only the operand stack has to be
+// restored, when a guard fails and the trace exits into the interpreter.
+
+// Operand stack entries of the trace compiler, that are tracked.
+// Deeper entries are stored in the vm stack.
+#define TRACE_STACK 64
+
+// Register of the operand stack entries (by position), the others are stored
+static const int trace_gprs[] = {RSI, RDI, R8, R9, R10, R11, R14, R15};
+#define TRACE_GPRS 8
+#define TRACE_XMMS 14
+#define TRACE_XMM(pos) ((pos) + 2)
+
+// Condition codes
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+
+// Location of an operand stack entry
+typedef enum {
+    TRACE_MEM,
+    TRACE_CONST,
+    TRACE_GPR,
+    TRACE_XMM
+} trace_kind_t;
+
+// @obj The value can be an object
+// @value Value of a constant
+typedef struct {
+    trace_kind_t kind;
+    bool obj;
+    val_t value;
+} trace_entry_t;
+
+// Side exit, stores the operand stack and continues the interpreter at @pc
+// @patch Position of the jump displacement of the guard
+typedef struct {
+    int patch;
+    int pc;
+    int top;
+    trace_entry_t* stack;
+} trace_exit_t;
+
+// Slot of a variable, @global for gload / gstore
+typedef struct {
+    bool global;
+    int offset;
+} trace_slot_t;
+
+// Trace compiler state
+// @top Position of the stack pointer, relative to the stack pointer at the loop header
+// @known Slots, that are known to hold no object
+typedef struct {
+    bytecode_t* bytecode;
+    jit_code_t j;
+    trace_entry_t stack[TRACE_STACK];
+    int top;
+    trace_slot_t known[TRACE_STACK];
+    int num_known;
+    trace_exit_t* exits;
+    size_t num_exits;
+    bool valid;
+} trace_t;
+
+// Register to register instruction, @reg is the register operand or opcode extension
+void jit_reg(jit_code_t* j, uint8_t prefix, bool w, const char* op, size_t oplen, int reg, int rm) {
+    if(prefix) jit_byte(j, prefix);
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if(rex != 0x40) jit_byte(j, rex);
+    jit_bytes(j, op, oplen);
+    jit_byte(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+#define JIT_REG(j, prefix, w, op, reg, rm) \
+    jit_reg(j, prefix, w, op, sizeof(op) - 1, reg, rm)
+
+// Entries below the loop header are stored and can be objects
+trace_entry_t* trace_entry(trace_t* t, int pos) {
+    static trace_entry_t stored = {TRACE_MEM, true, 0};
+    if(pos < 0 || pos >= TRACE_STACK) {
+        stored.kind = TRACE_MEM;
+        stored.obj = true;
+        return &stored;
+    }
+    return &t->stack[pos];
+}
+
+// Stores the entry at @pos in the vm stack
+void trace_spill(jit_code_t* j, int pos, trace_entry_t* e) {
+    switch(e->kind) {
+        case TRACE_CONST: {
+            jit_imm64(j, RAX, e->value);
+            STORE64(j, RAX, SP, 8 * pos);
+            break;
+        }
+        case TRACE_GPR: STORE64(j, trace_gprs[pos], SP, 8 * pos); break;
+        case TRACE_XMM: JIT_MEM(j, 0xf2, false, "\x0f\x11", TRACE_XMM(pos), SP, 8 * pos); break;
+        default: break;
+    }
+}
+
+// Stores all entries, required before helpers
+void trace_flush(trace_t* t) {
+    for(int pos = 0; pos < t->top && pos < TRACE_STACK; pos++) {
+        trace_spill(&t->j, pos, &t->stack[pos]);
+        t->stack[pos].kind = TRACE_MEM;
+    }
+}
+
+// Loads the boxed value of the entry at @pos into the scratch register @reg (rax, rcx)
+void trace_load(trace_t* t, int pos, int reg) {
+    jit_code_t* j = &t->j;
+    trace_entry_t* e = trace_entry(t, pos);
+    switch(e->kind) {
+        case TRACE_MEM: LOAD64(j, reg, SP, 8 * pos); break;
+        case TRACE_CONST: jit_imm64(j, reg, e->value); break;
+        case TRACE_GPR: JIT_REG(j, 0, true, "\x89", trace_gprs[pos], reg); break;
+        case TRACE_XMM: JIT_REG(j, 0x66, true, "\x0f\x7e", TRACE_XMM(pos), reg); break;
+    }
+}
+
+// Loads the double of the entry at @pos into the scratch register @xmm (xmm0, xmm1)
+void trace_load_xmm(trace_t* t, int pos, int xmm) {
+    jit_code_t* j = &t->j;
+    trace_entry_t* e = trace_entry(t, pos);
+    switch(e->kind) {
+        case TRACE_MEM: JIT_MEM(j, 0xf2, false, "\x0f\x10", xmm, SP, 8 * pos); break;
+        case TRACE_CONST: {
+            jit_imm64(j, RAX, e->value);
+            JIT_REG(j, 0x66, true, "\x0f\x6e", xmm, RAX);
+            break;
+        }
+        case TRACE_GPR: JIT_REG(j, 0x66, true, "\x0f\x6e", xmm, trace_gprs[pos]); break;
+        case TRACE_XMM: JIT_REG(j, 0x66, false, "\x0f\x28", xmm, TRACE_XMM(pos)); break;
+    }
+}
+
+// Pushes a new entry, returns null if it is not tracked
+trace_entry_t* trace_push(trace_t* t) {
+    int pos = t->top++;
+    if(pos >= TRACE_STACK) {
+        t->valid = false;
+        return 0;
+    }
+    return pos >= 0 ? &t->stack[pos] : 0;
+}
+
+// Pushes the boxed value of the scratch register @reg
+void trace_push_gpr(trace_t* t, int reg, bool obj) {
+    int pos = t->top;
+    trace_entry_t* e = trace_push(t);
+    if(e && pos < TRACE_GPRS) {
+        JIT_REG(&t->j, 0, true, "\x89", reg, trace_gprs[pos]);
+        e->kind = TRACE_GPR;
+    } else {
+        STORE64(&t->j, reg, SP, 8 * pos);
+        if(e) e->kind = TRACE_MEM;
+    }
+    if(e) e->obj = obj;
+}
+
+// Pushes the double of xmm0
+void trace_push_xmm(trace_t* t) {
+    int pos = t->top;
+    trace_entry_t* e = trace_push(t);
+    if(e && pos < TRACE_XMMS) {
+        JIT_REG(&t->j, 0x66, false, "\x0f\x28", TRACE_XMM(pos), XMM0);
+        e->kind = TRACE_XMM;
+    } else {
+        JIT_MEM(&t->j, 0xf2, false, "\x0f\x11", XMM0, SP, 8 * pos);
+        if(e) e->kind = TRACE_MEM;
+    }
+    if(e) e->obj = false;
+}
+
+void trace_push_const(trace_t* t, val_t val) {
+    int pos = t->top;
+    trace_entry_t* e = trace_push(t);
+    if(e) {
+        e->kind = TRACE_CONST;
+        e->obj = IS_OBJ(val);
+        e->value = val;
+    } else {
+        jit_imm64(&t->j, RAX, val);
+        STORE64(&t->j, RAX, SP, 8 * pos);
+    }
+}
+
+// Jumps to a side exit, if the condition @cc is met.
+// The interpreter continues with the instruction @pc and the current operand stack.
+void trace_guard(trace_t* t, uint8_t cc, int pc) {
+    jit_code_t* j = &t->j;
+    jit_byte(j, 0x0f);
+    jit_byte(j, 0x80 | cc);
+
+    t->exits = realloc(t->exits, sizeof(trace_exit_t) * (t->num_exits + 1));
+    trace_exit_t* exit = &t->exits[t->num_exits++];
+    exit->patch = j->len;
+    exit->pc = pc;
+    exit->top = t->top;
+    int count = (t->top < 0) ? 0 : (t->top > TRACE_STACK) ? TRACE_STACK : t->top;
+    exit->stack = malloc(sizeof(trace_entry_t) * (count + 1));
+    memcpy(exit->stack, t->stack, sizeof(trace_entry_t) * count);
+    jit_int32(j, 0);
+}
+
+// Conditional jump of the recorded step @jmpf, the condition @cc is set.
+// The trace follows the recorded direction, otherwise the interpreter executes the jump.
+void trace_branch(trace_t* t, uint8_t cc, jit_step_t* jmpf) {
+    bool cond = !jmpf->taken;
+    trace_push_const(t, BOOL_VAL(!cond));
+    trace_guard(t, cond ? cc ^ 1 : cc, jmpf->instr - t->bytecode->code);
+    t->top--;
+}
+
+// Memory operand of a variable
+int trace_base(trace_slot_t slot) {
+    return slot.global ? VM : FP;
+}
+
+int trace_disp(trace_slot_t slot) {
+    return 8 * slot.offset + (slot.global ? (int)offsetof(vm_t, stack) : 0);
+}
+
+bool trace_known(trace_t* t, trace_slot_t slot) {
+    for(int i = 0; i < t->num_known; i++) {
+        if(t->known[i].global == slot.global && t->known[i].offset == slot.offset) return true;
+    }
+    return false;
+}
+
+void trace_set_known(trace_t* t, trace_slot_t slot, bool known) {
+    for(int i = 0; i < t->num_known; i++) {
+        if(t->known[i].global == slot.global && t->known[i].offset == slot.offset) {
+            if(!known) t->known[i] = t->known[--t->num_known];
+            return;
+        }
+    }
+    if(known && t->num_known < TRACE_STACK) {
+        t->known[t->num_known++] = slot;
+    }
+}
+
+// Stores the stack index of the entry at @pos in a field of the vm
+void trace_set_index(trace_t* t, int pos, int field) {
+    jit_code_t* j = &t->j;
+    JIT_MEM(j, 0, true, "\x8d", RAX, SP, 8 * pos);      // lea rax, [rbx + 8 * pos]
+    JIT_MEM(j, 0, true, "\x8d", RCX, VM, offsetof(vm_t, stack));
+    jit_bytes(j, "\x48\x29\xc8", 3);             // sub rax, rcx
+    jit_bytes(j, "\x48\xc1\xf8\x03", 4);         // sar rax, 3
+    JIT_MEM(j, 0, false, "\x89", RAX, VM, field);
+}
+
+// Type guard: exits, if the value in rax is an object
+void trace_guard_obj(trace_t* t, int pc) {
+    jit_code_t* j = &t->j;
+    jit_bytes(j, "\x48\x89\xc1", 3);             // mov rcx, rax
+    jit_bytes(j, "\x48\xc1\xe9\x32", 4);         // shr rcx, 50
+    jit_bytes(j, "\x81\xf9", 2);                 // cmp ecx, imm32
+    jit_int32(j, (int32_t)((QNAN | SIGN_BIT) >> 50));
+    trace_guard(t, CC_E, pc);
+}
+
+// Calls a helper (see jit_helper), the result has the type of @obj
+void trace_helper(trace_t* t, void* fn, code_t* instr, bool obj) {
+    jit_code_t* j = &t->j;
+    trace_flush(t);
+    JIT_MEM(j, 0, true, "\x8d", RSI, SP, 8 * t->top); // lea rsi, [rbx + 8 * top]
+    jit_bytes(j, "\x4c\x89\xef", 3);             // mov rdi, r13
+    jit_bytes(j, "\x4c\x89\xe2", 3);             // mov rdx, r12
+    jit_imm64(j, RCX, (uint64_t)(uintptr_t)instr);
+    jit_imm64(j, RAX, (uint64_t)(uintptr_t)fn);
+    jit_bytes(j, "\xff\xd0", 2);                 // call rax
+
+    // The results of the helper
+    int top = t->top + vm_stack_effect(instr);
+    int start = (top < t->top) ? top - 1 : t->top - 1;
+    for(int pos = start; pos < top; pos++) {
+        if(pos >= 0 && pos < TRACE_STACK) {
+            t->stack[pos].kind = TRACE_MEM;
+            t->stack[pos].obj = obj;
+        }
+    }
+    t->top = top;
+    if(top > TRACE_STACK) t->valid = false;
+}
+
+// Integer comparison of the operands in eax and ecx.
+// If a conditional jump follows, it is compiled into a guard.
+void trace_compare(trace_t* t, uint8_t cc, jit_step_t* jmpf) {
+    jit_code_t* j = &t->j;
+    if(jmpf) {
+        trace_branch(t, cc, jmpf);
+        return;
+    }
+
+    jit_byte(j, 0x0f);
+    jit_byte(j, 0x90 | cc);
+    jit_bytes(j, "\xc0\x0f\xb6\xc0", 4);         // setcc al; movzx eax, al
+    jit_imm64(j, RCX, FALSE_VAL);
+    jit_bytes(j, "\x48\x01\xc8", 3);             // add rax, rcx
+    trace_push_gpr(t, RAX, false);
+}
+
+// Pops two integers into eax and ecx
+void trace_int_operands(trace_t* t) {
+    trace_load(t, t->top - 2, RAX);
+    trace_load(t, t->top - 1, RCX);
+    t->top -= 2;
+}
+
+// Pops two doubles into xmm0 and xmm1
+void trace_float_operands(trace_t* t) {
+    trace_load_xmm(t, t->top - 2, XMM0);
+    trace_load_xmm(t, t->top - 1, XMM1);
+    t->top -= 2;
+}
+
+// Compiles the recorded step @i, returns the number of steps consumed
+size_t trace_emit(trace_t* t, jit_step_t* steps, size_t i, size_t num_steps) {
+    jit_code_t* j = &t->j;
+    jit_step_t* step = &steps[i];
+    code_t* instr = step->instr;
+    int pc = instr - t->bytecode->code;
+    trace_slot_t slot = {instr->op == OP_GLOAD || instr->op == OP_GSTORE || instr->op == OP_GINC, instr->a};
+
+    // A comparison followed by its conditional jump
+    jit_step_t* jmpf = 0;
+    if(i + 1 < num_steps && steps[i+1].instr == instr + 1 && instr[1].op == OP_JMPF) {
+        jmpf = &steps[i+1];
+    }
+
+    switch(instr->op) {
+        case OP_PUSH:
+        case OP_PUSHK: {
+            // Constant objects are pinned (see code_push)
+            val_t val = t->bytecode->consts[instr->a];
+            if(instr->op == OP_PUSH) RETAIN_VAL(val);
+            trace_push_const(t, val);
+            break;
+        }
+        case OP_POP: t->top--; break;
+        case OP_LOAD:
+        case OP_GLOAD: {
+            LOAD64(j, RAX, trace_base(slot), trace_disp(slot));
+            if(!step->obj && !trace_known(t, slot)) {
+                trace_guard_obj(t, pc);
+                trace_set_known(t, slot, true);
+            }
+            trace_push_gpr(t, RAX, step->obj);
+            break;
+        }
+        case OP_STORE:
+        case OP_GSTORE: {
+            // Objects are counted by the helper, other values are moved
+            trace_entry_t* e = trace_entry(t, t->top - 1);
+            if(step->obj || e->obj) {
+                trace_helper(t, instr->op == OP_STORE ? jit_store : jit_gstore, instr, true);
+                trace_set_known(t, slot, false);
+                break;
+            }
+            if(!trace_known(t, slot)) {
+                LOAD64(j, RAX, trace_base(slot), trace_disp(slot));
+                trace_guard_obj(t, pc);
+                trace_set_known(t, slot, true);
+            }
+            int pos = t->top - 1;
+            if(e->kind == TRACE_XMM) {
+                JIT_MEM(j, 0xf2, false, "\x0f\x11", TRACE_XMM(pos), trace_base(slot), trace_disp(slot));
+            } else {
+                trace_load(t, pos, RAX);
+                STORE64(j, RAX, trace_base(slot), trace_disp(slot));
+            }
+            t->top--;
+            break;
+        }
+        case OP_SYSCALL: trace_helper(t, jit_syscall, instr, true); break;
+        case OP_RESERVE: {
+            // New variables are cleared, freed variables are guarded to hold no object.
+            // Objects have to be released by the helper.
+            int sz = instr->a;
+            if(step->obj) {
+                trace_helper(t, jit_reserve, instr, true);
+                break;
+            }
+            trace_flush(t);
+            if(sz > 0) {
+                jit_imm64(j, RAX, NULL_VAL);
+                for(int i = 0; i < sz; i++) {
+                    STORE64(j, RAX, SP, 8 * (t->top + i));
+                }
+            } else {
+                for(int i = sz; i < 0; i++) {
+                    LOAD64(j, RAX, SP, 8 * (t->top + i));
+                    trace_guard_obj(t, pc);
+                }
+            }
+            for(int i = 0; i < sz; i++) {
+                trace_entry_t* e = trace_push(t);
+                if(e) {
+                    e->kind = TRACE_MEM;
+                    e->obj = true;
+                }
+            }
+            if(sz < 0) t->top += sz;
+            trace_set_index(t, t->top, offsetof(vm_t, lp));
+            break;
+        }
+        case OP_GETSUB:
+        case OP_AGETSUB:
+        case OP_SGETSUB: trace_helper(t, jit_getsub, instr, true); break;
+        case OP_LEN:
+        case OP_ALEN:
+        case OP_SLEN: trace_helper(t, jit_len, instr, false); break;
+        case OP_TOSTR: trace_helper(t, jit_tostr, instr, true); break;
+        case OP_APPEND:
+        case OP_SAPPEND: trace_helper(t, jit_sappend, instr, true); break;
+        case OP_FEQ:
+        case OP_FNE: trace_helper(t, jit_feq, instr, false); break;
+        case OP_JMP: break;
+        case OP_JMPF: {
+            // Constant conditions always take the recorded direction
+            trace_entry_t* e = trace_entry(t, t->top - 1);
+            if(e->kind == TRACE_CONST) {
+                t->top--;
+                break;
+            }
+            trace_load(t, t->top - 1, RAX);
+            t->top--;
+            jit_imm64(j, RCX, TRUE_VAL);
+            jit_bytes(j, "\x48\x39\xc8", 3);     // cmp rax, rcx
+            trace_branch(t, CC_E, step);
+            break;
+        }
+
+        // Integers, the results of 32-bit operations are zero extended (boxed)
+        case OP_IADD:
+        case OP_ISUB:
+        case OP_BITAND:
+        case OP_BITOR:
+        case OP_BITXOR: {
+            static const char ops[] = {0x01, 0x29, 0x21, 0x09, 0x31};
+            int index = (instr->op <= OP_ISUB) ? instr->op - OP_IADD : 2 + instr->op - OP_BITAND;
+            trace_int_operands(t);
+            jit_reg(j, 0, false, &ops[index], 1, RCX, RAX); // op eax, ecx
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_IMUL: {
+            trace_int_operands(t);
+            JIT_REG(j, 0, false, "\x0f\xaf", RAX, RCX);
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_IDIV:
+        case OP_MOD: {
+            trace_int_operands(t);
+            jit_byte(j, 0x99);                   // cdq
+            JIT_REG(j, 0, false, "\xf7", 7, RCX); // idiv ecx
+            if(instr->op == OP_MOD) jit_bytes(j, "\x89\xd0", 2); // mov eax, edx
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_BITL:
+        case OP_BITR: {
+            trace_int_operands(t);
+            jit_bytes(j, instr->op == OP_BITL ? "\xd3\xe0" : "\xd3\xf8", 2); // shl / sar eax, cl
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_BITNOT:
+        case OP_IMINUS: {
+            trace_load(t, --t->top, RAX);
+            jit_bytes(j, instr->op == OP_BITNOT ? "\xf7\xd0" : "\xf7\xd8", 2); // not / neg eax
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_I2F: {
+            trace_load(t, --t->top, RAX);
+            JIT_REG(j, 0xf2, false, "\x0f\x2a", XMM0, RAX); // cvtsi2sd xmm0, eax
+            trace_push_xmm(t);
+            break;
+        }
+        case OP_IEQ:
+        case OP_INE:
+        case OP_ILT:
+        case OP_IGT:
+        case OP_ILE:
+        case OP_IGE: {
+            static const uint8_t cc[] = {CC_E, CC_NE, CC_L, CC_G, CC_LE, CC_GE};
+            int index = (instr->op == OP_IEQ) ? 0 : (instr->op == OP_INE) ? 1 : 2 + instr->op - OP_ILT;
+            trace_int_operands(t);
+            jit_bytes(j, "\x39\xc8", 2);         // cmp eax, ecx
+            trace_compare(t, cc[index], jmpf);
+            return jmpf ? 2 : 1;
+        }
+
+        // Floats
+        case OP_FADD:
+        case OP_FSUB:
+        case OP_FMUL:
+        case OP_FDIV: {
+            static const char* ops[] = {"\x0f\x58", "\x0f\x5c", "\x0f\x59", "\x0f\x5e"};
+            trace_float_operands(t);
+            jit_reg(j, 0xf2, false, ops[instr->op - OP_FADD], 2, XMM0, XMM1);
+            trace_push_xmm(t);
+            break;
+        }
+        case OP_FMINUS: {
+            trace_load(t, --t->top, RAX);
+            jit_bytes(j, "\x48\x0f\xba\xf8\x3f", 5); // btc rax, 63
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_F2I: {
+            trace_load_xmm(t, --t->top, XMM0);
+            JIT_REG(j, 0xf2, false, "\x0f\x2c", RAX, XMM0); // cvttsd2si eax, xmm0
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        // Unordered (NaN) compares as false, like in C
+        case OP_FLT:
+        case OP_FGT:
+        case OP_FLE:
+        case OP_FGE: {
+            bool swap = (instr->op == OP_FLT || instr->op == OP_FLE);
+            trace_float_operands(t);
+            if(swap) {
+                JIT_REG(j, 0x66, false, "\x0f\x2e", XMM1, XMM0); // ucomisd xmm1, xmm0
+            } else {
+                JIT_REG(j, 0x66, false, "\x0f\x2e", XMM0, XMM1);
+            }
+            trace_compare(t, (instr->op == OP_FLT || instr->op == OP_FGT) ? CC_A : CC_AE, jmpf);
+            return jmpf ? 2 : 1;
+        }
+
+        // Bools, true and false only differ in the lowest bit
+        case OP_NOT: {
+            trace_load(t, --t->top, RAX);
+            jit_bytes(j, "\x48\x83\xf0\x01", 4); // xor rax, 1
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_B2I: {
+            trace_load(t, --t->top, RAX);
+            jit_bytes(j, "\x83\xe0\x01", 3);     // and eax, 1
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_BEQ:
+        case OP_BNE: {
+            trace_int_operands(t);
+            jit_bytes(j, "\x48\x39\xc8", 3);     // cmp rax, rcx
+            trace_compare(t, instr->op == OP_BEQ ? CC_E : CC_NE, jmpf);
+            return jmpf ? 2 : 1;
+        }
+        case OP_BAND:
+        case OP_BOR: {
+            trace_int_operands(t);
+            jit_bytes(j, instr->op == OP_BAND ? "\x48\x21\xc8" : "\x48\x09\xc8", 3); // and / or rax, rcx
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+
+        // Superinstructions
+        case OP_LLIADD: {
+            LOAD32(j, RAX, FP, 8 * instr->a);
+            JIT_MEM(j, 0, false, "\x03", RAX, FP, 8 * instr->b);
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_LKIADD:
+        case OP_LKISUB: {
+            LOAD32(j, RAX, FP, 8 * instr->a);
+            jit_byte(j, instr->op == OP_LKIADD ? 0x05 : 0x2d); // add / sub eax, imm32
+            jit_int32(j, instr->b);
+            trace_push_gpr(t, RAX, false);
+            break;
+        }
+        case OP_LINC:
+        case OP_GINC: {
+            LOAD32(j, RAX, trace_base(slot), trace_disp(slot));
+            jit_byte(j, 0x05);                   // add eax, imm32
+            jit_int32(j, instr->b);
+            STORE64(j, RAX, trace_base(slot), trace_disp(slot));
+            trace_set_known(t, slot, true);
+            break;
+        }
+        case OP_ILTJMPF: {
+            // The interpreter repeats the comparison on exit
+            trace_load(t, t->top - 2, RAX);
+            trace_load(t, t->top - 1, RCX);
+            jit_bytes(j, "\x39\xc8", 2);         // cmp eax, ecx
+            trace_guard(t, step->taken ? CC_L : CC_GE, pc);
+            t->top -= 2;
+            break;
+        }
+        case OP_LKILTJMPF: {
+            LOAD32(j, RAX, FP, 8 * instr->a);
+            jit_byte(j, 0x3d);                   // cmp eax, imm32
+            jit_int32(j, instr->b);
+            trace_guard(t, step->taken ? CC_L : CC_GE, pc);
+            break;
+        }
+        default: t->valid = false; break;
+    }
+    return 1;
+}
+
+// Instructions, that can be recorded
+bool jit_traceable(code_t* instr, val_t* sp) {
+    switch(instr->op) {
+        case OP_PUSH:
+        case OP_PUSHK:
+        case OP_POP:
+        case OP_LOAD:
+        case OP_GLOAD:
+        case OP_STORE:
+        case OP_GSTORE:
+        case OP_SYSCALL:
+        case OP_RESERVE:
+        case OP_JMP:
+        case OP_JMPF:
+        case OP_TOSTR:
+        case OP_GETSUB:
+        case OP_AGETSUB:
+        case OP_SGETSUB:
+        case OP_LEN:
+        case OP_ALEN:
+        case OP_SLEN:
+        case OP_LLIADD:
+        case OP_LKIADD:
+        case OP_LKISUB:
+        case OP_LINC:
+        case OP_GINC:
+        case OP_ILTJMPF:
+        case OP_LKILTJMPF: return true;
+        case OP_APPEND:
+        case OP_SAPPEND: return IS_STRING(sp[-2]);
+        default: {
+            if(instr->op >= OP_IADD && instr->op <= OP_B2I) return true;
+            if(instr->op >= OP_BEQ && instr->op <= OP_BOR) return true;
+            return false;
+        }
+    }
+}
+
+bool jit_trace_compile(jit_t* jit, int header) {
+    trace_t* t = calloc(1, sizeof(trace_t));
+    jit_code_t* j = &t->j;
+    t->bytecode = jit->bytecode;
+    t->valid = true;
+
+    // Prologue: push rbx; push r12; push r13; push r14; push r15;
+    // mov r13, rdi; mov r12, rsi; mov rbx, rdx
+    jit_bytes(j, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9);
+    jit_bytes(j, "\x49\x89\xfd\x49\x89\xf4\x48\x89\xd3", 9);
+
+    size_t loop = j->len;
+    for(size_t i = 0; i < jit->num_steps && t->valid; ) {
+        i += trace_emit(t, jit->steps, i, jit->num_steps);
+    }
+
+    // The back edge is entered with the stack of the loop header
+    t->valid = t->valid && t->top == 0;
+    jit_byte(j, 0xe9);
+    jit_int32(j, (int32_t)loop - (int32_t)(j->len + 4));
+
+    // Side exits: the operand stack is stored, vm->pc and vm->sp are set
+    for(size_t i = 0; i < t->num_exits; i++) {
+        trace_exit_t* exit = &t->exits[i];
+        int32_t rel = j->len - (exit->patch + 4);
+        memcpy(&j->buf[exit->patch], &rel, sizeof(rel));
+
+        for(int pos = 0; pos < exit->top && pos < TRACE_STACK; pos++) {
+            trace_spill(j, pos, &exit->stack[pos]);
+        }
+        JIT_MEM(j, 0, false, "\xc7", 0, VM, offsetof(vm_t, pc)); // mov dword [r13 + pc], imm32
+        jit_int32(j, exit->pc);
+        trace_set_index(t, exit->top, offsetof(vm_t, sp));
+        jit_bytes(j, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\xc3", 10); // pop r15 - rbx; ret
+        free(exit->stack);
+    }
+
+    void* mem = MAP_FAILED;
+    if(t->valid) {
+        mem = mmap(0, j->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    bool valid = (mem != MAP_FAILED);
+    if(valid) {
+        memcpy(mem, j->buf, j->len);
+        valid = mprotect(mem, j->len, PROT_READ | PROT_EXEC) == 0;
+        if(valid) {
+            jit->traces[header] = (jit_trace_fn_t)mem;
+            jit->trace_size[header] = j->len;
+        } else {
+            munmap(mem, j->len);
+        }
+    }
+
+    free(j->buf);
+    free(t->exits);
+    free(t);
+    return valid;
+}
+
+// Stops the recording, the handlers are restored
+void jit_record_stop(jit_t* jit, bool compile) {
+    int header = jit->header;
+    code_t* code = jit->bytecode->code;
+    for(size_t i = 0; i < jit->bytecode->len; i++) {
+        if(code[i].handler == jit->record) code[i].handler = jit->handlers[i];
+    }
+    jit->header = -1;
+
+    bool valid = compile && jit_trace_compile(jit, header);
+    jit->loop_state[header] = valid ? JIT_DONE : JIT_FAILED;
+}
+
+jit_trace_fn_t jit_loop(jit_t* jit, int header, void* record) {
+    if(jit->loop_state[header] == JIT_DONE) return jit->traces[header];
+    if(jit->loop_state[header] != JIT_NONE || jit->header != -1) return 0;
+    if(++jit->loops[header] < JIT_LOOP_THRESHOLD) return 0;
+
+    // Every instruction is recorded, until the loop header is reached again
+    code_t* code = jit->bytecode->code;
+    for(size_t i = 0; i < jit->bytecode->len; i++) {
+        jit->handlers[i] = code[i].handler;
+        code[i].handler = record;
+    }
+    jit->loop_state[header] = JIT_BUSY;
+    jit->header = header;
+    jit->record = record;
+    jit->num_steps = 0;
+    return 0;
+}
+
+void jit_record(vm_t* vm, code_t* instr, val_t* sp, val_t* fp) {
+    jit_t* jit = vm->jit;
+    int pc = instr - jit->bytecode->code;
+    if(jit->num_steps == 0) {
+        jit->record_sp = sp - vm->stack;
+    }
+
+    // The back edge closes the trace
+    if(instr->op == OP_JMP && instr->a == jit->header) {
+        jit_record_stop(jit, sp - vm->stack == jit->record_sp);
+        return;
+    }
+
+    // Calls, inner loops and other instructions are not traced
+    if(jit->num_steps >= JIT_TRACE_LENGTH || !jit_traceable(instr, sp)
+        || (instr->op == OP_JMP && instr->a <= pc)) {
+        jit_record_stop(jit, false);
+        return;
+    }
+
+    jit_step_t* step = &jit->steps[jit->num_steps++];
+    step->instr = instr;
+    step->obj = false;
+    step->taken = false;
+    switch(instr->op) {
+        case OP_LOAD: step->obj = IS_OBJ(fp[instr->a]); break;
+        case OP_GLOAD: step->obj = IS_OBJ(vm->stack[instr->a]); break;
+        case OP_STORE: step->obj = IS_OBJ(fp[instr->a]) || IS_OBJ(sp[-1]); break;
+        case OP_GSTORE: step->obj = IS_OBJ(vm->stack[instr->a]) || IS_OBJ(sp[-1]); break;
+        case OP_JMPF: step->taken = !AS_BOOL(sp[-1]); break;
+        case OP_RESERVE: {
+            for(int i = instr->a; i < 0; i++) {
+                if(IS_OBJ(sp[i])) step->obj = true;
+            }
+            break;
+        }
+        case OP_ILTJMPF: step->taken = !(AS_INT32(sp[-2]) < AS_INT32(sp[-1])); break;
+        case OP_LKILTJMPF: step->taken = !(AS_INT32(fp[instr->a]) < instr->b); break;
+        default: break;
+    }
+}
+
+void jit_trace_call(vm_t* vm, jit_trace_fn_t fn, val_t* fp, val_t* sp) {
+    if(setjmp(vm->jit->escape)) {
+        return;
+    }
+    fn(vm, fp, sp);
+}
+
+void jit_free(jit_t* jit) {
+    if(!jit) return;
+    if(jit->bytecode) {
+        for(size_t i = 0; i < jit->bytecode->len; i++) {
+            if(jit->native[i]) munmap((void*)jit->native[i], jit->size[i]);
+            if(jit->traces[i]) munmap((void*)jit->traces[i], jit->trace_size[i]);
+        }
+    }
+    free(jit->calls);
+    free(jit->state);
+    free(jit->native);
+    free(jit->size);
+    free(jit->loops);
+    free(jit->loop_state);
+    free(jit->traces);
+    free(jit->trace_size);
+    free(jit->steps);
+    free(jit->handlers);
+    free(jit);
+}
+
+#else
+
+// The JIT is only available on x86-64 Linux
+jit_t* jit_new() {
+    return 0;
+}
+
+void jit_load(jit_t* jit, bytecode_t* bytecode) {}
+
+jit_fn_t jit_enter(jit_t* jit, int entry) {
+    return 0;
+}
+
+val_t* jit_call(vm_t* vm, jit_fn_t fn, val_t* fp) {
+    return 0;
+}
+
+jit_trace_fn_t jit_loop(jit_t* jit, int header, void* record) {
+    return 0;
+}
+
+void jit_record(vm_t* vm, code_t* instr, val_t* sp, val_t* fp) {}
+
+void jit_trace_call(vm_t* vm, jit_trace_fn_t fn, val_t* fp, val_t* sp) {}
+
+void jit_free(jit_t* jit) {}
+
+#endif
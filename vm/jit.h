@@ -0,0 +1,85 @@
+/**
+ * jit.h
+ * Copyright (C) 2017 Alexander Koch
+ * Baseline template JIT (x86-64 Linux)
+ *
+ * Functions that are called often are translated into native code,
+ * by stitching together a machine code template for every instruction.
+ * Simple instructions (integer / float arithmetic, comparisons, loads, jumps)
+ * are inlined, complex instructions call helper functions written in C.
+ *
+ * Native code works on the vm stack like the interpreter:
+ *
+ * rbx <-- sp
+ * r12 <-- fp
+ * r13 <-- vm
+ *
+ * A function is only compiled, if all of its instructions are supported
+ * and all functions it calls can be compiled as well.
+ * Otherwise it stays in the interpreter.
+ *
+ * Hot loops of the interpreter are traced: after JIT_LOOP_THRESHOLD back edges
+ * one iteration is recorded while it is executed (the handlers are replaced by a recording handler).
+ * The recorded path is compiled into a native loop. Operand stack values are kept
+ * unboxed in registers, variables are guarded to hold no object on their first use.
+ * Conditional jumps become guards: if an iteration leaves the recorded path,
+ * the operand stack is stored and the interpreter continues (side exit).
+ * Loops with calls, inner loops or unsupported instructions are not traced.
+ *
+ * On other platforms the JIT is not available (jit_new returns null).
+ */
+
+#ifndef jit_h
+#define jit_h
+
+#include <vm/vm.h>
+
+// Calls of a function until it is compiled
+#define JIT_THRESHOLD 50
+
+// Native function, runs the frame at @fp and returns the stack pointer after the return
+typedef val_t* (*jit_fn_t)(vm_t* vm, val_t* fp);
+
+// Back edges of a loop until it is traced, maximum length of a trace
+#define JIT_LOOP_THRESHOLD 50
+#define JIT_TRACE_LENGTH 256
+
+// Native trace, runs the loop with the frame at @fp and the stack pointer @sp.
+// On exit vm->pc and vm->sp are set to continue in the interpreter.
+typedef void (*jit_trace_fn_t)(vm_t* vm, val_t* fp, val_t* sp);
+
+jit_t* jit_new();
+
+/**
+ * Binds the JIT to the code, that is executed.
+ * Has to be called before execution.
+ */
+void jit_load(jit_t* jit, bytecode_t* bytecode);
+
+/**
+ * Counts a call of the function at @entry and compiles it, once it is hot.
+ * Returns the native code or null, if the function is interpreted.
+ */
+jit_fn_t jit_enter(jit_t* jit, int entry);
+
+/**
+ * Runs native code for the frame at @fp, the frame header has to be pushed.
+ * Returns the stack pointer after the return or null, if an exception was thrown.
+ */
+val_t* jit_call(vm_t* vm, jit_fn_t fn, val_t* fp);
+
+/**
+ * Counts a back edge to the loop @header.
+ * Returns the native trace or null, if the loop is interpreted.
+ * Once the loop is hot, all handlers are replaced by @record to record the next iteration.
+ */
+jit_trace_fn_t jit_loop(jit_t* jit, int header, void* record);
+
+// Records the instruction, before it is executed
+void jit_record(vm_t* vm, code_t* instr, val_t* sp, val_t* fp);
+
+// Runs a trace, the interpreter continues at vm->pc (also after exceptions)
+void jit_trace_call(vm_t* vm, jit_trace_fn_t fn, val_t* fp, val_t* sp);
+void jit_free(jit_t* jit);
+
+#endif
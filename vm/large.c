@@ -0,0 +1,90 @@
+// Copyright (C) 2017 Alexander Koch
+#include "rawmem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "large.h"
+
+// The size of the mapping is stored before the payload, which stays aligned to 16 bytes
+#define LARGE_HEADER 16
+
+#if defined(__unix__) && defined(__GNUC__)
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// New payloads are written at once, their pages are faulted in by one call
+#ifdef MAP_POPULATE
+#define LARGE_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE)
+#else
+#define LARGE_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS)
+#endif
+
+static size_t large_mapping(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + LARGE_HEADER + page - 1) & ~(page - 1);
+}
+
+static void* large_fail() {
+    fprintf(stderr, "Fatal error: Mapping of a large object failed\n");
+    abort();
+}
+
+void* large_alloc(size_t size) {
+    size_t len = large_mapping(size);
+    char* map = mmap(0, len, PROT_READ | PROT_WRITE, LARGE_FLAGS, -1, 0);
+    if(map == MAP_FAILED) return large_fail();
+    *(size_t*)map = len;
+    return map + LARGE_HEADER;
+}
+
+void* large_realloc(void* ptr, size_t size) {
+    char* map = (char*)ptr - LARGE_HEADER;
+    size_t old = *(size_t*)map;
+    size_t len = large_mapping(size);
+    if(len == old) return ptr;
+
+#ifdef __linux__
+    // The pages are moved, not copied
+    map = mremap(map, old, len, MREMAP_MAYMOVE);
+    if(map == MAP_FAILED) return large_fail();
+    *(size_t*)map = len;
+    return map + LARGE_HEADER;
+#else
+    char* grown = large_alloc(size);
+    memcpy(grown, ptr, ((old < len) ? old : len) - LARGE_HEADER);
+    large_free(ptr);
+    return grown;
+#endif
+}
+
+void large_free(void* ptr) {
+    char* map = (char*)ptr - LARGE_HEADER;
+    munmap(map, *(size_t*)map);
+}
+
+#else
+
+void* large_alloc(size_t size) {
+    char* mem = malloc(size + LARGE_HEADER);
+    if(!mem) {
+        fprintf(stderr, "Fatal error: Allocation of a large object failed\n");
+        abort();
+    }
+    return mem + LARGE_HEADER;
+}
+
+void* large_realloc(void* ptr, size_t size) {
+    char* mem = realloc((char*)ptr - LARGE_HEADER, size + LARGE_HEADER);
+    if(!mem) {
+        fprintf(stderr, "Fatal error: Allocation of a large object failed\n");
+        abort();
+    }
+    return mem + LARGE_HEADER;
+}
+
+void large_free(void* ptr) {
+    free((char*)ptr - LARGE_HEADER);
+}
+
+#endif
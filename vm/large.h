@@ -0,0 +1,27 @@
+/**
+ * large.h
+ * Copyright (C) 2017 Alexander Koch
+ * Large-object space of the object payloads
+ *
+ * Payloads of at least LARGE_MIN bytes (big arrays and strings) are mapped from the system,
+ * every one in its own mapping, instead of sharing the malloc heap with small objects.
+ * They are never moved by the collector (see pool_evacuate), a growing array is remapped.
+ * The mapping is returned to the system, as soon as the payload is freed.
+ *
+ * Without mmap the payloads are allocated with malloc.
+ */
+
+#ifndef large_h
+#define large_h
+
+#include <stddef.h>
+
+#define LARGE_MIN (128 * 1024)
+
+// Allocates @size bytes, @size should be at least LARGE_MIN
+void* large_alloc(size_t size);
+// Changes the size, the contents are kept up to the smaller size
+void* large_realloc(void* ptr, size_t size);
+void large_free(void* ptr);
+
+#endif
@@ -0,0 +1,232 @@
+// Copyright (C) 2017 Alexander Koch
+#include "rawmem.h"
+#include <stdlib.h>
+#include "parmark.h"
+#include "heap.h"
+
+#if defined(__unix__) && defined(__GNUC__)
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct parmark_t parmark_t;
+
+// @stack Private mark stack, only used by the worker itself
+// @shared Objects, that can be stolen by the other workers (guarded by @lock)
+// @bytes Bytes of the old objects marked by the worker (see vm_t.markedBytes)
+typedef struct {
+    parmark_t* pm;
+    int id;
+    pthread_t thread;
+    gc_grey_t* stack;
+    int num;
+    int cap;
+    size_t bytes;
+    gc_grey_t shared[PARMARK_BATCH];
+    int numShared;
+    char lock;
+} parmark_worker_t;
+
+// @count Started workers, @idle Workers without work
+// @go Set, when all workers are started
+struct parmark_t {
+    vm_t* vm;
+    parmark_worker_t* workers;
+    int count;
+    int idle;
+    int go;
+};
+
+static void parmark_lock(char* lock) {
+    while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED));
+    }
+}
+
+static void parmark_unlock(char* lock) {
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static void parmark_push(parmark_worker_t* w, gc_grey_t grey) {
+    if(w->num >= w->cap) {
+        w->cap = (w->cap < 256) ? 256 : w->cap * 2;
+        w->stack = realloc(w->stack, sizeof(gc_grey_t) * w->cap);
+    }
+    w->stack[w->num++] = grey;
+}
+
+static void parmark_mark(parmark_worker_t* w, val_t v) {
+    if(!IS_OBJ(v)) return;
+    obj_t* obj = AS_OBJ(v);
+
+    // Only the worker, that sets the mark bit, scans the object
+    if(!heap_mark_atomic(obj)) return;
+    if(!obj->young) w->bytes += obj_size(obj);
+    if(obj->type == OBJ_ARRAY || obj->type == OBJ_CLASS) {
+        PREFETCH(obj->data);
+        parmark_push(w, (gc_grey_t){obj, 0});
+    }
+}
+
+// Scans a chunk of the object on top of the private stack (see markChunk)
+static void parmark_scan(parmark_worker_t* w) {
+    gc_grey_t* grey = &w->stack[w->num - 1];
+    obj_t* obj = grey->obj;
+    val_t* fields;
+    size_t to;
+    if(obj->type == OBJ_CLASS) {
+        fields = ((obj_class_t*)obj->data)->fields;
+        to = ((obj_class_t*)obj->data)->field_count;
+    } else {
+        fields = ((obj_array_t*)obj->data)->data;
+        to = ((obj_array_t*)obj->data)->len;
+    }
+
+    size_t from = grey->next;
+    if(to - from > MARK_CHUNK) {
+        to = from + MARK_CHUNK;
+        grey->next = to;
+    } else {
+        w->num--;
+    }
+
+    for(size_t i = from; i < to; i++) {
+        if(i + MARK_PREFETCH < to && IS_OBJ(fields[i + MARK_PREFETCH])) {
+            PREFETCH(AS_OBJ(fields[i + MARK_PREFETCH]));
+        }
+        parmark_mark(w, fields[i]);
+    }
+}
+
+// Moves the top of the private stack into the shared part, if the others took it
+static void parmark_share(parmark_worker_t* w) {
+    if(w->num < 2 || __atomic_load_n(&w->numShared, __ATOMIC_RELAXED) > 0) return;
+
+    int n = w->num / 2;
+    if(n > PARMARK_BATCH) n = PARMARK_BATCH;
+    w->num -= n;
+
+    parmark_lock(&w->lock);
+    memcpy(w->shared, &w->stack[w->num], sizeof(gc_grey_t) * n);
+    __atomic_store_n(&w->numShared, n, __ATOMIC_RELAXED);
+    parmark_unlock(&w->lock);
+}
+
+// Takes the shared objects of the worker itself or half of the shared objects of another one
+static bool parmark_steal(parmark_worker_t* w, parmark_worker_t* victim) {
+    if(__atomic_load_n(&victim->numShared, __ATOMIC_RELAXED) == 0) return false;
+
+    parmark_lock(&victim->lock);
+    int n = victim->numShared;
+    int take = (victim == w) ? n : (n + 1) / 2;
+    for(int i = n - take; i < n; i++) {
+        parmark_push(w, victim->shared[i]);
+    }
+    __atomic_store_n(&victim->numShared, n - take, __ATOMIC_RELAXED);
+    parmark_unlock(&victim->lock);
+    return take > 0;
+}
+
+static bool parmark_shared_any(parmark_t* pm) {
+    for(int i = 0; i < pm->count; i++) {
+        if(__atomic_load_n(&pm->workers[i].numShared, __ATOMIC_RELAXED) > 0) return true;
+    }
+    return false;
+}
+
+static bool parmark_steal_any(parmark_worker_t* w) {
+    parmark_t* pm = w->pm;
+    for(int i = 1; i < pm->count; i++) {
+        if(parmark_steal(w, &pm->workers[(w->id + i) % pm->count])) return true;
+    }
+    return false;
+}
+
+static void* parmark_work(void* arg) {
+    parmark_worker_t* w = arg;
+    parmark_t* pm = w->pm;
+    while(!__atomic_load_n(&pm->go, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+
+    vm_t* vm = pm->vm;
+    for(int i = w->id; i < vm->sp; i += pm->count) {
+        parmark_mark(w, vm->stack[i]);
+    }
+
+    for(;;) {
+        while(w->num > 0) {
+            parmark_scan(w);
+            parmark_share(w);
+        }
+        if(parmark_steal(w, w) || parmark_steal_any(w)) continue;
+
+        // Only the owner fills a shared part, so workers with shared objects are not idle.
+        // If all workers are idle, no work is left.
+        __atomic_add_fetch(&pm->idle, 1, __ATOMIC_ACQ_REL);
+        for(;;) {
+            if(__atomic_load_n(&pm->idle, __ATOMIC_ACQUIRE) == pm->count) return 0;
+
+            if(parmark_shared_any(pm)) {
+                __atomic_sub_fetch(&pm->idle, 1, __ATOMIC_ACQ_REL);
+                if(parmark_steal_any(w)) break;
+                __atomic_add_fetch(&pm->idle, 1, __ATOMIC_ACQ_REL);
+            }
+            sched_yield();
+        }
+    }
+}
+
+int parmark_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1) return 1;
+    if(n > PARMARK_THREADS) return PARMARK_THREADS;
+    return (int)n;
+}
+
+bool parmark_run(vm_t* vm, int threads) {
+    if(threads > PARMARK_THREADS) threads = PARMARK_THREADS;
+
+    parmark_t pm = {0};
+    pm.vm = vm;
+    pm.workers = calloc(threads, sizeof(parmark_worker_t));
+    pm.count = 1;
+    pm.workers[0].pm = &pm;
+
+    // Workers that could not be started are left out
+    for(int i = 1; i < threads; i++) {
+        parmark_worker_t* w = &pm.workers[i];
+        w->pm = &pm;
+        w->id = i;
+        if(pthread_create(&w->thread, 0, parmark_work, w)) break;
+        pm.count++;
+    }
+    if(pm.count == 1) {
+        free(pm.workers);
+        return false;
+    }
+
+    __atomic_store_n(&pm.go, 1, __ATOMIC_RELEASE);
+    parmark_work(&pm.workers[0]);
+    for(int i = 0; i < pm.count; i++) {
+        if(i > 0) pthread_join(pm.workers[i].thread, 0);
+        vm->markedBytes += pm.workers[i].bytes;
+        free(pm.workers[i].stack);
+    }
+    free(pm.workers);
+    return true;
+}
+
+#else
+
+int parmark_threads() {
+    return 1;
+}
+
+bool parmark_run(vm_t* vm, int threads) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,37 @@
+/**
+ * parmark.h
+ * Copyright (C) 2017 Alexander Koch
+ * Parallel marking of the full collection (vm_gc)
+ *
+ * The slots of the vm stack are split across the workers, the calling thread is worker 0.
+ * Every worker marks on a private stack without locks. When its shared part is empty,
+ * a worker moves up to PARMARK_BATCH objects into it, from where idle workers steal them
+ * (work stealing). Mark bits are set atomically, so every object is scanned by one worker.
+ * The marking is done, when all workers are idle.
+ *
+ * Only available with POSIX threads, otherwise parmark_run returns false and
+ * the heap is marked serially.
+ */
+
+#ifndef parmark_h
+#define parmark_h
+
+#include <vm/vm.h>
+
+// Heaps with fewer objects are marked serially, unless GOLEM_GC_THREADS is set (see vm_gc_config)
+#define PARMARK_MIN_OBJECTS 100000
+// Maximum number of workers
+#define PARMARK_THREADS 64
+// Maximum number of objects shared at once
+#define PARMARK_BATCH 128
+
+// Number of online processors, at least 1
+int parmark_threads();
+
+/**
+ * Marks everything reachable from the stack with @threads workers.
+ * Returns false, if the workers could not be started (nothing is marked then).
+ */
+bool parmark_run(vm_t* vm, int threads);
+
+#endif
@@ -0,0 +1,146 @@
+// Copyright (C) 2017 Alexander Koch
+#include "rawmem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "pool.h"
+
+// Chunks start after the header, aligned to POOL_ALIGN
+#define POOL_FIRST ((sizeof(pool_page_t) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+// @avail Pages with free chunks per size class, @numPages All pages per size class
+// @evacuated Pages, whose chunks are moved (see pool_evacuate_start)
+static struct {
+    pool_page_t* avail[POOL_CLASSES];
+    int numPages[POOL_CLASSES];
+    pool_page_t* evacuated;
+} pool;
+
+static inline pool_page_t* pool_page(void* ptr) {
+    return (pool_page_t*)((uintptr_t)ptr & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+}
+
+static inline int pool_class(size_t size) {
+    return (int)((size + POOL_ALIGN - 1) / POOL_ALIGN) - 1;
+}
+
+static void pool_avail_push(pool_page_t* page, int cls) {
+    page->avail = true;
+    page->prev = 0;
+    page->next = pool.avail[cls];
+    if(pool.avail[cls]) pool.avail[cls]->prev = page;
+    pool.avail[cls] = page;
+}
+
+static void pool_avail_remove(pool_page_t* page, int cls) {
+    page->avail = false;
+    if(page->prev) page->prev->next = page->next;
+    else pool.avail[cls] = page->next;
+    if(page->next) page->next->prev = page->prev;
+}
+
+static pool_page_t* pool_page_new(int cls) {
+    void* mem = 0;
+    if(posix_memalign(&mem, POOL_PAGE_SIZE, POOL_PAGE_SIZE)) {
+        fprintf(stderr, "Fatal error: Allocation of a pool page failed\n");
+        abort();
+    }
+
+    pool_page_t* page = mem;
+    page->free = 0;
+    page->top = (char*)page + POOL_FIRST;
+    page->size = (size_t)(cls + 1) * POOL_ALIGN;
+    page->numUsed = 0;
+    page->evacuate = false;
+    pool.numPages[cls]++;
+    pool_avail_push(page, cls);
+    return page;
+}
+
+void* pool_alloc(size_t size) {
+    int cls = pool_class(size);
+    pool_page_t* page = pool.avail[cls] ? pool.avail[cls] : pool_page_new(cls);
+
+    void* ptr = page->free;
+    if(ptr) {
+        page->free = *(void**)ptr;
+    } else {
+        ptr = page->top;
+        page->top += page->size;
+    }
+    page->numUsed++;
+
+    if(!page->free && page->top + page->size > (char*)page + POOL_PAGE_SIZE) {
+        pool_avail_remove(page, cls);
+    }
+    return ptr;
+}
+
+static void pool_evacuated_remove(pool_page_t* page) {
+    page->evacuate = false;
+    if(page->prev) page->prev->next = page->next;
+    else pool.evacuated = page->next;
+    if(page->next) page->next->prev = page->prev;
+}
+
+void pool_free(void* ptr) {
+    pool_page_t* page = pool_page(ptr);
+    int cls = pool_class(page->size);
+    *(void**)ptr = page->free;
+    page->free = ptr;
+    page->numUsed--;
+
+    // Empty pages are released, unless it is the last one of the class
+    if(page->numUsed == 0 && pool.numPages[cls] > 1) {
+        if(page->avail) pool_avail_remove(page, cls);
+        if(page->evacuate) pool_evacuated_remove(page);
+        pool.numPages[cls]--;
+        free(page);
+        return;
+    }
+    if(!page->avail && !page->evacuate) pool_avail_push(page, cls);
+}
+
+int pool_evacuate_start() {
+    int count = 0;
+    for(int cls = 0; cls < POOL_CLASSES; cls++) {
+        if(pool.numPages[cls] < 2) continue;
+
+        // Pages, that were never full, are not fragmented
+        pool_page_t* page = pool.avail[cls];
+        while(page) {
+            pool_page_t* next = page->next;
+            size_t chunks = (POOL_PAGE_SIZE - POOL_FIRST) / page->size;
+            if(page->free && (size_t)page->numUsed * POOL_SPARSE <= chunks) {
+                pool_avail_remove(page, cls);
+                page->evacuate = true;
+                page->prev = 0;
+                page->next = pool.evacuated;
+                if(pool.evacuated) pool.evacuated->prev = page;
+                pool.evacuated = page;
+                count++;
+            }
+            page = next;
+        }
+    }
+    return count;
+}
+
+void* pool_evacuate(void* ptr) {
+    pool_page_t* page = pool_page(ptr);
+    if(!page->evacuate) return ptr;
+
+    void* chunk = pool_alloc(page->size);
+    memcpy(chunk, ptr, page->size);
+    pool_free(ptr);
+    return chunk;
+}
+
+void pool_evacuate_end() {
+    while(pool.evacuated) {
+        pool_page_t* page = pool.evacuated;
+        pool_evacuated_remove(page);
+        pool_avail_push(page, pool_class(page->size));
+    }
+}
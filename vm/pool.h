@@ -0,0 +1,55 @@
+/**
+ * pool.h
+ * Copyright (C) 2017 Alexander Koch
+ * Size-class pool of the object payloads
+ *
+ * Small payloads (array and class structs, short strings) are allocated from pages of
+ * POOL_PAGE_SIZE bytes, that are aligned to their size. Every page serves one size class
+ * (multiples of POOL_ALIGN up to POOL_MAX), chunks are taken from the free list of the page
+ * or by bumping its top pointer. A page is released as a whole, when its last chunk is freed.
+ *
+ * Pages, that keep a few chunks after their neighbours were freed, are compacted:
+ * their chunks are moved to other pages (see pool_evacuate), until they are empty.
+ */
+
+#ifndef pool_h
+#define pool_h
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define POOL_PAGE_SIZE 16384
+#define POOL_ALIGN 16
+#define POOL_MAX 256
+#define POOL_CLASSES (POOL_MAX / POOL_ALIGN)
+// Pages with freed chunks using at most 1/POOL_SPARSE of their chunks are evacuated
+#define POOL_SPARSE 4
+
+// @free Freed chunks, linked by their first word
+// @top First chunk, that was never allocated
+// @avail The page is in the list of pages with free chunks
+// @evacuate The chunks of the page are moved (it is in the list of evacuated pages instead)
+typedef struct pool_page_t {
+    struct pool_page_t* prev;
+    struct pool_page_t* next;
+    void* free;
+    char* top;
+    size_t size;
+    int numUsed;
+    bool avail;
+    bool evacuate;
+} pool_page_t;
+
+// Allocates a chunk of at least @size bytes, @size must not exceed POOL_MAX
+void* pool_alloc(size_t size);
+void pool_free(void* ptr);
+
+// Selects the sparse pages for evacuation, returns their count.
+// They get no new chunks until pool_evacuate_end.
+int pool_evacuate_start();
+// Moves the chunk to another page, if its page is evacuated. Returns the new chunk.
+void* pool_evacuate(void* ptr);
+// Pages, that still have chunks, are used again
+void pool_evacuate_end();
+
+#endif
@@ -0,0 +1,27 @@
+/**
+ * rawmem.h
+ * Copyright (C) 2017 Alexander Koch
+ * System memory of the collector
+ *
+ * Pages, mappings and the mark stacks of the workers are allocated beside the memory tracker
+ * (see core/mem.h): they are not objects of the program, and the tracker is not thread-safe.
+ * The header is included first by these files. It enables the POSIX and Linux functions,
+ * that are not part of c99 (posix_memalign, mmap, mremap, pthreads), and removes the macros
+ * of the tracker from the file.
+ */
+
+#ifndef rawmem_h
+#define rawmem_h
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+// The macros are defined once, later includes of the tracker do not restore them
+#include <core/mem.h>
+#undef malloc
+#undef realloc
+#undef calloc
+#undef free
+
+#endif
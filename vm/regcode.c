@@ -0,0 +1,340 @@
+// Copyright (C) 2017 Alexander Koch
+#include "regcode.h"
+#include <vm/vm.h>
+
+// Stack entry kinds of the translator
+// Real entries are stored in their slot, the others are used as operands directly.
+typedef enum {
+    ENTRY_REAL,
+    ENTRY_LOCAL,
+    ENTRY_GLOBAL,
+    ENTRY_CONST
+} entry_kind_t;
+
+typedef struct {
+    entry_kind_t kind;
+    int value;
+} entry_t;
+
+// Translator state
+// @stack Operand stack of the current instruction, including the local variables
+// @depth Stack height of the current instruction (sp - fp)
+typedef struct {
+    bytecode_t* bytecode;
+    code_t* out;
+    size_t len;
+    size_t cap;
+    entry_t stack[STACK_SIZE];
+    int depth;
+} regcode_t;
+
+// Register variants of the binary operations
+// @reg uses two slots, @regk a slot and an integer constant (-1 if not available).
+// Comparisons followed by jmpf use the branch variants @jmpf and @jmpfk.
+typedef struct {
+    opcode_t op;
+    opcode_t reg;
+    int regk;
+    int jmpf;
+    int jmpfk;
+} regop_t;
+
+static const regop_t regops[] = {
+    {OP_IADD, OP_RIADD, OP_RIADDK, -1, -1},
+    {OP_ISUB, OP_RISUB, OP_RISUBK, -1, -1},
+    {OP_IMUL, OP_RIMUL, -1, -1, -1},
+    {OP_IDIV, OP_RIDIV, -1, -1, -1},
+    {OP_MOD, OP_RMOD, -1, -1, -1},
+    {OP_IEQ, OP_RIEQ, OP_RIEQK, OP_RIEQJ, OP_RIEQKJ},
+    {OP_INE, OP_RINE, OP_RINEK, OP_RINEJ, OP_RINEKJ},
+    {OP_ILT, OP_RILT, OP_RILTK, OP_RILTJ, OP_RILTKJ},
+    {OP_IGT, OP_RIGT, OP_RIGTK, OP_RIGTJ, OP_RIGTKJ},
+    {OP_ILE, OP_RILE, OP_RILEK, OP_RILEJ, OP_RILEKJ},
+    {OP_IGE, OP_RIGE, OP_RIGEK, OP_RIGEJ, OP_RIGEKJ},
+    {OP_FADD, OP_RFADD, -1, -1, -1},
+    {OP_FSUB, OP_RFSUB, -1, -1, -1},
+    {OP_FMUL, OP_RFMUL, -1, -1, -1},
+    {OP_FDIV, OP_RFDIV, -1, -1, -1},
+    {OP_FLT, OP_RFLT, -1, -1, -1},
+    {OP_FGT, OP_RFGT, -1, -1, -1},
+    {OP_FLE, OP_RFLE, -1, -1, -1},
+    {OP_FGE, OP_RFGE, -1, -1, -1}
+};
+
+const regop_t* regop_find(opcode_t op) {
+    for(size_t i = 0; i < sizeof(regops) / sizeof(regops[0]); i++) {
+        if(regops[i].op == op) return &regops[i];
+    }
+    return 0;
+}
+
+// Height of the stored part of the stack
+int regcode_height(regcode_t* r) {
+    int h = r->depth;
+    while(h > 0 && r->stack[h-1].kind != ENTRY_REAL) h--;
+    return h;
+}
+
+void regcode_emit(regcode_t* r, opcode_t op, int a, int b, int c) {
+    if(r->len >= r->cap) {
+        r->cap = (r->cap < 16) ? 16 : r->cap * 2;
+        r->out = realloc(r->out, sizeof(code_t) * r->cap);
+    }
+
+    code_t* code = &r->out[r->len++];
+    code->op = op;
+    code->h = regcode_height(r);
+    code->a = a;
+    code->b = b;
+    code->c = c;
+}
+
+// Stores the entry at index @i in its slot
+void regcode_materialize(regcode_t* r, int i) {
+    entry_t* e = &r->stack[i];
+    if(e->kind == ENTRY_REAL) return;
+
+    entry_kind_t kind = e->kind;
+    e->kind = ENTRY_REAL;
+    switch(kind) {
+        case ENTRY_LOCAL: regcode_emit(r, OP_RMOV, i, e->value, 0); break;
+        case ENTRY_GLOBAL: regcode_emit(r, OP_RMOVG, i, e->value, 0); break;
+        case ENTRY_CONST: regcode_emit(r, OP_RMOVK, i, e->value, 0); break;
+        default: break;
+    }
+}
+
+// Stores all entries, required before a stack instruction and at jumps
+void regcode_flush(regcode_t* r) {
+    for(int i = 0; i < r->depth; i++) {
+        regcode_materialize(r, i);
+    }
+}
+
+// Stores all entries below @top that still refer to the variable @slot.
+// Locals and globals are the same slots at top level (fp = 0).
+void regcode_flush_slot(regcode_t* r, int top, int slot) {
+    for(int i = 0; i < top; i++) {
+        entry_t* e = &r->stack[i];
+        if((e->kind == ENTRY_LOCAL || e->kind == ENTRY_GLOBAL) && e->value == slot) {
+            regcode_materialize(r, i);
+        }
+    }
+}
+
+// Returns the slot of the entry at index @i
+int regcode_operand(regcode_t* r, int i) {
+    entry_t* e = &r->stack[i];
+    if(e->kind == ENTRY_LOCAL) return e->value;
+    regcode_materialize(r, i);
+    return i;
+}
+
+void regcode_push(regcode_t* r, entry_kind_t kind, int value) {
+    r->stack[r->depth].kind = kind;
+    r->stack[r->depth].value = value;
+    r->depth++;
+}
+
+// Translates a binary operation, returns the number of consumed instructions.
+// If the next instruction stores the result, it is written to the variable directly.
+// If it is a conditional jump, the comparison branches directly.
+int regcode_binary(regcode_t* r, const regop_t* regop, code_t* next) {
+    int i = r->depth - 2;
+    entry_t* rhs = &r->stack[i+1];
+
+    // Integer constants are immediate operands
+    bool imm = regop->regk != -1 && rhs->kind == ENTRY_CONST
+        && IS_INT32(r->bytecode->consts[rhs->value]);
+    int x = regcode_operand(r, i);
+    int y = imm ? AS_INT32(r->bytecode->consts[rhs->value]) : regcode_operand(r, i+1);
+    opcode_t op = imm ? (opcode_t)regop->regk : regop->reg;
+
+    r->depth -= 2;
+    if(next && next->op == OP_JMPF && regop->jmpf != -1) {
+        regcode_flush(r);
+        regcode_emit(r, imm ? regop->jmpfk : regop->jmpf, x, y, next->a);
+        return 2;
+    }
+
+    if(next && next->op == OP_STORE) {
+        regcode_flush_slot(r, r->depth, next->a);
+        regcode_emit(r, op, next->a, x, y);
+        return 2;
+    }
+
+    regcode_push(r, ENTRY_REAL, 0);
+    regcode_emit(r, op, i, x, y);
+    return 1;
+}
+
+// Copies a stack instruction, pushed values are stored.
+// The operands of the instruction have to be stored already.
+void regcode_copy(regcode_t* r, code_t* code) {
+    if(r->len >= r->cap) {
+        r->cap = (r->cap < 16) ? 16 : r->cap * 2;
+        r->out = realloc(r->out, sizeof(code_t) * r->cap);
+    }
+    r->out[r->len++] = *code;
+
+    int depth = r->depth;
+    r->depth += vm_stack_effect(code);
+    for(int i = depth; i < r->depth; i++) {
+        r->stack[i].kind = ENTRY_REAL;
+    }
+}
+
+bool regcode_translate(bytecode_t* bytecode) {
+    size_t len = bytecode->len;
+    int* height = malloc(sizeof(int) * len);
+    if(!vm_stack_heights(bytecode, height)) {
+        free(height);
+        return false;
+    }
+
+    // Code, that overflows the stack, is left to the stack VM (see vm_frame_sizes)
+    for(size_t i = 0; i < len; i++) {
+        if(height[i] != -1 && vm_stack_after(&bytecode->code[i], height[i]) >= STACK_SIZE) {
+            free(height);
+            return false;
+        }
+    }
+
+    // Jump targets must be entered with a stored stack
+    bool* leader = calloc(len, sizeof(bool));
+    for(size_t i = 0; i < len; i++) {
+        int* addr = bytecode_target(&bytecode->code[i]);
+        if(addr) leader[*addr] = true;
+    }
+
+    regcode_t* r = calloc(1, sizeof(regcode_t));
+    r->bytecode = bytecode;
+    size_t* map = malloc(sizeof(size_t) * len);
+    bool known = false;
+
+    for(size_t pc = 0; pc < len; pc++) {
+        code_t* code = &bytecode->code[pc];
+
+        // New basic block, the stack is stored
+        if(leader[pc] || !known) {
+            if(known) regcode_flush(r);
+            known = height[pc] != -1;
+            r->depth = known ? height[pc] : 0;
+            for(int i = 0; i < r->depth; i++) {
+                r->stack[i].kind = ENTRY_REAL;
+            }
+        }
+        map[pc] = r->len;
+
+        // Unreachable code is copied
+        if(!known) {
+            regcode_copy(r, code);
+            continue;
+        }
+
+        // The next instruction, if it can be merged
+        code_t* next = 0;
+        if(pc + 1 < len && !leader[pc+1] && height[pc+1] != -1) {
+            next = &bytecode->code[pc+1];
+        }
+
+        entry_t* top = r->depth > 0 ? &r->stack[r->depth-1] : 0;
+        const regop_t* regop = regop_find(code->op);
+        switch(code->op) {
+            case OP_LOAD: regcode_push(r, ENTRY_LOCAL, code->a); break;
+            case OP_GLOAD: regcode_push(r, ENTRY_GLOBAL, code->a); break;
+            case OP_PUSH: {
+                if(!IS_OBJ(bytecode->consts[code->a])) {
+                    regcode_push(r, ENTRY_CONST, code->a);
+                } else {
+                    regcode_flush(r);
+                    regcode_copy(r, code);
+                }
+                break;
+            }
+            case OP_POP: {
+                if(top->kind != ENTRY_REAL) {
+                    r->depth--;
+                } else {
+                    regcode_copy(r, code);
+                }
+                break;
+            }
+            case OP_STORE: {
+                // Constants are not owned, they can be moved directly
+                regcode_flush_slot(r, r->depth-1, code->a);
+                if(top->kind == ENTRY_CONST) {
+                    r->depth--;
+                    regcode_emit(r, OP_RMOVK, code->a, top->value, 0);
+                } else {
+                    regcode_materialize(r, r->depth-1);
+                    regcode_copy(r, code);
+                }
+                break;
+            }
+            case OP_GSTORE: {
+                regcode_flush_slot(r, r->depth-1, code->a);
+                regcode_materialize(r, r->depth-1);
+                regcode_copy(r, code);
+                break;
+            }
+            case OP_RET: {
+                if(top->kind == ENTRY_LOCAL) {
+                    int slot = top->value;
+                    r->depth--;
+                    regcode_flush(r);
+                    regcode_emit(r, OP_RRET, slot, 0, 0);
+                } else {
+                    regcode_flush(r);
+                    regcode_copy(r, code);
+                }
+                break;
+            }
+            case OP_JMPF: {
+                if(top->kind == ENTRY_LOCAL) {
+                    int slot = top->value;
+                    r->depth--;
+                    regcode_flush(r);
+                    regcode_emit(r, OP_RJMPF, slot, code->a, 0);
+                } else {
+                    regcode_flush(r);
+                    regcode_copy(r, code);
+                }
+                break;
+            }
+            default: {
+                if(regop && (top->kind != ENTRY_REAL || r->stack[r->depth-2].kind != ENTRY_REAL)) {
+                    pc += regcode_binary(r, regop, next) - 1;
+                } else if(regop) {
+                    // Both operands are stored, the stack version is used
+                    regcode_copy(r, code);
+                } else {
+                    regcode_flush(r);
+                    regcode_copy(r, code);
+                }
+                break;
+            }
+        }
+
+        // Control flow ends, the next instruction starts a new block
+        if(code->op == OP_JMP || code->op == OP_RET || code->op == OP_RETVIRTUAL || code->op == OP_HLT) {
+            known = false;
+        }
+    }
+
+    // Resolve the jump addresses
+    for(size_t i = 0; i < r->len; i++) {
+        int* addr = bytecode_target(&r->out[i]);
+        if(addr) *addr = map[*addr];
+    }
+
+    free(bytecode->code);
+    bytecode->code = r->out;
+    bytecode->len = r->len;
+
+    free(map);
+    free(r);
+    free(leader);
+    free(height);
+    return true;
+}
@@ -0,0 +1,35 @@
+/**
+ * regcode.h
+ * Copyright (C) 2017 Alexander Koch
+ * Register-based execution mode
+ *
+ * Translates the stack bytecode of the compiler into register code.
+ * Register instructions are three-address instructions over frame slots
+ * (fp-relative, like load and store), values of the operand stack live
+ * in the slots the stack VM would push them to.
+ *
+ * riadd d, x, y  <-- slot[d] = slot[x] + slot[y]
+ * riaddk d, x, k <-- slot[d] = slot[x] + k
+ *
+ * Loads and constants are not pushed, they are used as operands directly,
+ * arithmetic followed by a store writes the variable directly.
+ * After a register instruction the stack pointer is set to fp + h,
+ * so that all other instructions can still run on the stack.
+ *
+ * The stack height of every instruction has to be known statically,
+ * otherwise the code is not translated.
+ */
+
+#ifndef regcode_h
+#define regcode_h
+
+#include <stdbool.h>
+#include <vm/bytecode.h>
+
+/**
+ * Converts the stack code into register code.
+ * Returns false, if the code could not be translated, it is not modified then.
+ */
+bool regcode_translate(bytecode_t* bytecode);
+
+#endif
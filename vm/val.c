@@ -1,5 +1,8 @@
 // Copyright (C) 2017 Alexander Koch
 #include "val.h"
+#include "heap.h"
+#include "pool.h"
+#include "large.h"
 
 // Conversion struct
 typedef union {
@@ -48,6 +51,8 @@ bool val_equal(val_t v1, val_t v2) {
     return v1 == v2;
 }
 
+// Shallow copy of an object.
+// Sub-objects are not copied, they are shared with the new object instead.
 obj_t* obj_copy(obj_t* obj) {
     switch(obj->type) {
         case OBJ_STRING: return obj_string_new(obj->data);
@@ -55,13 +60,12 @@ obj_t* obj_copy(obj_t* obj) {
             obj_array_t* old = obj->data;
 
             // Create a new array
-            val_t* arr = malloc(sizeof(val_t) * old->len);
+            obj_t* newArr = obj_array_new(old->len);
+            val_t* arr = ((obj_array_t*)newArr->data)->data;
             for(size_t i = 0; i < old->len; i++) {
-                arr[i] = val_copy(old->data[i]);
+                arr[i] = old->data[i];
+                RETAIN_VAL(arr[i]);
             }
-
-            // Create the corresponding object
-            obj_t* newArr = obj_array_new(arr, old->len);
             return newArr;
         }
         case OBJ_CLASS: {
@@ -71,9 +75,10 @@ obj_t* obj_copy(obj_t* obj) {
             obj_t* clsObj = obj_class_new(cls->field_count);
             obj_class_t* newCls = clsObj->data;
 
-            // Copy all the fields
+            // Share all the fields
             for(size_t i = 0; i < newCls->field_count; i++) {
-                newCls->fields[i] = val_copy(cls->fields[i]);
+                newCls->fields[i] = cls->fields[i];
+                RETAIN_VAL(newCls->fields[i]);
             }
 
             return clsObj;
@@ -94,29 +99,103 @@ val_t val_copy(val_t val) {
     }
 }
 
+obj_nursery_t* obj_nursery = 0;
+
+// Size of the payload of an array with @cap elements / a class with @fields fields
+#define ARRAY_SIZE(cap) (sizeof(obj_array_t) + sizeof(val_t) * (cap))
+#define CLASS_SIZE(fields) (sizeof(obj_class_t) + sizeof(val_t) * (fields))
+
+// Small payloads are allocated in the pool (see pool.h), large ones in the large-object space
+static void* obj_payload_alloc(size_t size) {
+    if(size <= POOL_MAX) return pool_alloc(size);
+    if(size >= LARGE_MIN) return large_alloc(size);
+    return malloc(size);
+}
+
+static void obj_payload_free(void* ptr, size_t size) {
+    if(size <= POOL_MAX) pool_free(ptr);
+    else if(size >= LARGE_MIN) large_free(ptr);
+    else free(ptr);
+}
+
+// Resizes a payload of @old bytes, it is moved, if it changes the allocator
+static void* obj_payload_realloc(void* ptr, size_t old, size_t size) {
+    if(old >= LARGE_MIN && size >= LARGE_MIN) return large_realloc(ptr, size);
+    if(old > POOL_MAX && old < LARGE_MIN && size > POOL_MAX && size < LARGE_MIN) return realloc(ptr, size);
+
+    void* moved = obj_payload_alloc(size);
+    memcpy(moved, ptr, (old < size) ? old : size);
+    obj_payload_free(ptr, old);
+    return moved;
+}
+
+// Every object is registered once, when it is allocated.
+// Containers only reference registered objects, so their content is never scanned here.
 obj_t* obj_new() {
-    obj_t* obj = malloc(sizeof(*obj));
+    obj_t* obj = heap_alloc();
     obj->type = OBJ_NULL;
     obj->data = 0;
-    obj->marked = 0;
-    obj->next = 0;
+    obj->refs = 0;
+    obj->young = 0;
+    obj->remembered = 0;
+    obj->pooled = 0;
+    obj->large = 0;
+
+    obj_nursery_t* n = obj_nursery;
+    if(n) {
+        if(n->num >= n->cap) {
+            n->cap = (n->cap < 64) ? 64 : n->cap * 2;
+            n->objs = realloc(n->objs, sizeof(obj_t*) * n->cap);
+        }
+        obj->young = 1;
+        n->objs[n->num++] = obj;
+    }
     return obj;
 }
 
-obj_t* obj_string_const_new(const char* str) {
+// Short strings are allocated in the pool, long ones in the large-object space
+static void obj_string_alloc(obj_t* obj, size_t len) {
+    obj->pooled = len < POOL_MAX;
+    obj->large = !obj->pooled && len + 1 >= LARGE_MIN;
+    if(obj->pooled) obj->data = pool_alloc(len + 1);
+    else if(obj->large) obj->data = large_alloc(len + 1);
+    else obj->data = malloc(sizeof(char) * (len + 1));
+}
+
+static void obj_string_free(obj_t* obj) {
+    if(obj->pooled) pool_free(obj->data);
+    else if(obj->large) large_free(obj->data);
+    else free(obj->data);
+}
+
+// String with an uninitialized buffer for @len characters and the trailing zero.
+obj_t* obj_string_buffer_new(size_t len) {
     obj_t* obj = obj_new();
     obj->type = OBJ_STRING;
-    obj->data = strdup(str);
+    obj_string_alloc(obj, len);
     return obj;
 }
 
-obj_t* obj_string_new(char* str) {
-    obj_t* obj = obj_new();
-    obj->type = OBJ_STRING;
-    obj->data = strdup(str);
+// Keeps the first @len characters, the buffer is reallocated for them
+void obj_string_shrink(obj_t* obj, size_t len) {
+    obj_t old = *obj;
+    obj_string_alloc(obj, len);
+    memcpy(obj->data, old.data, len);
+    ((char*)obj->data)[len] = '\0';
+    obj_string_free(&old);
+}
+
+obj_t* obj_string_const_new(const char* str) {
+    size_t len = strlen(str);
+    obj_t* obj = obj_string_buffer_new(len);
+    memcpy(obj->data, str, len + 1);
     return obj;
 }
 
+obj_t* obj_string_new(char* str) {
+    return obj_string_const_new(str);
+}
+
 obj_t* obj_string_nocopy_new(char* str) {
     obj_t* obj = obj_new();
     obj->type = OBJ_STRING;
@@ -124,52 +203,97 @@ obj_t* obj_string_nocopy_new(char* str) {
     return obj;
 }
 
-obj_t* obj_array_new(val_t* data, size_t length) {
+// Array with @length uninitialized elements
+obj_t* obj_array_new(size_t length) {
     obj_t* obj = obj_new();
     obj->type = OBJ_ARRAY;
 
-    obj_array_t* arr = malloc(sizeof(*arr));
-    arr->data = data;
+    obj_array_t* arr = obj_payload_alloc(ARRAY_SIZE(length));
     arr->len = length;
+    arr->cap = length;
 
     obj->data = arr;
     return obj;
 }
 
+// Appends a value to an array.
+// The capacity grows geometrically, so that appending is amortized O(1).
+// The elements are moved with the payload, so pointers to it become invalid.
+void obj_array_push(obj_t* obj, val_t val) {
+    obj_array_t* arr = obj->data;
+    if(arr->len >= arr->cap) {
+        size_t cap = (arr->cap < 4) ? 4 : arr->cap * 2;
+        arr = obj_payload_realloc(arr, ARRAY_SIZE(arr->cap), ARRAY_SIZE(cap));
+        arr->cap = cap;
+        obj->data = arr;
+    }
+    arr->data[arr->len++] = val;
+}
+
 obj_t* obj_class_new(int fields) {
     obj_t* obj = obj_new();
     obj->type = OBJ_CLASS;
 
-    // Class data
-    obj_class_t* cls = malloc(sizeof(*cls));
-    cls->fields = calloc(sizeof(val_t), fields);
+    // Class data, the fields are cleared
+    obj_class_t* cls = obj_payload_alloc(CLASS_SIZE(fields));
+    memset(cls->fields, 0, sizeof(val_t) * fields);
     cls->field_count = fields;
 
     obj->data = cls;
     return obj;
 }
 
+// Moves the payload out of an evacuated pool page (see pool_evacuate_start).
+// Only the object references its payload, so no other pointer has to be changed.
+void obj_evacuate(obj_t* obj) {
+    switch(obj->type) {
+        case OBJ_ARRAY: {
+            obj_array_t* arr = obj->data;
+            if(ARRAY_SIZE(arr->cap) <= POOL_MAX) obj->data = pool_evacuate(arr);
+            break;
+        }
+        case OBJ_STRING: {
+            if(obj->pooled) obj->data = pool_evacuate(obj->data);
+            break;
+        }
+        case OBJ_CLASS: {
+            obj_class_t* cls = obj->data;
+            if(CLASS_SIZE(cls->field_count) <= POOL_MAX) obj->data = pool_evacuate(cls);
+            break;
+        }
+        default: break;
+    }
+}
+
 void obj_free(obj_t* obj) {
     switch(obj->type) {
         case OBJ_ARRAY: {
             obj_array_t* arr = obj->data;
-            free(arr->data);
-            free(obj->data);
+            obj_payload_free(arr, ARRAY_SIZE(arr->cap));
             break;
         }
         case OBJ_STRING: {
-            free(obj->data);
+            obj_string_free(obj);
             break;
         }
         case OBJ_CLASS: {
-            free(((obj_class_t*)obj->data)->fields);
-            free(obj->data);
+            obj_class_t* cls = obj->data;
+            obj_payload_free(cls, CLASS_SIZE(cls->field_count));
             break;
         }
         default: break;
     }
-    free(obj);
-    obj = 0;
+    heap_free(obj);
+}
+
+// Bytes of the object, the header and the payload
+size_t obj_size(obj_t* obj) {
+    switch(obj->type) {
+        case OBJ_STRING: return sizeof(obj_t) + strlen(obj->data) + 1;
+        case OBJ_ARRAY: return sizeof(obj_t) + ARRAY_SIZE(((obj_array_t*)obj->data)->cap);
+        case OBJ_CLASS: return sizeof(obj_t) + CLASS_SIZE(((obj_class_t*)obj->data)->field_count);
+        default: return sizeof(obj_t);
+    }
 }
 
 void val_free(val_t v1) {
@@ -48,15 +48,18 @@
 
 typedef uint64_t val_t;
 
-// Class subtype
+// Class subtype, the fields follow in the same allocation
 typedef struct obj_class_t {
-    val_t* fields;
     unsigned int field_count;
+    val_t fields[];
 } obj_class_t;
 
+// Growable array, the elements follow in the same allocation.
+// @cap is the number of allocated elements
 typedef struct obj_array_t {
-    val_t* data;
     size_t len;
+    size_t cap;
+    val_t data[];
 } obj_array_t;
 
 // Object types
@@ -68,20 +71,50 @@ typedef enum obj_type_t {
 } obj_type_t;
 
 // Object definition
+//
+// Objects have value semantics, but are shared until they are modified (copy-on-write).
+// @refs counts the owners of the object: stack slots written by a store,
+// array elements, class fields and the arguments / pending operands of a call.
+// Plain operands on the stack are not counted.
+// An object may only be modified in place if it has no other owner,
+// otherwise it has to be copied first (see obj_copy).
+// @young The object is in the nursery of the collector (see vm_gc_minor)
+// @remembered The object is old and references young objects
+// @pooled The string data is allocated in the pool (see pool.h)
+// @large The string data is allocated in the large-object space (see large.h)
+// Objects are allocated in the page heap, the mark bits are kept there (see heap.h).
 typedef struct obj_t {
     obj_type_t type;
     void* data;
-    unsigned char marked;
-    struct obj_t* next;
+    int refs;
+    unsigned char young;
+    unsigned char remembered;
+    unsigned char pooled;
+    unsigned char large;
 } obj_t;
 
+// Objects allocated while a vm is running are registered in its nursery (see vm_gc_minor),
+// others (e.g. the constants of the bytecode) are not collected.
+typedef struct obj_nursery_t {
+    obj_t** objs;
+    int num;
+    int cap;
+} obj_nursery_t;
+
+extern obj_nursery_t* obj_nursery;
+
 obj_t* obj_new();
+obj_t* obj_string_buffer_new(size_t len);
+void obj_string_shrink(obj_t* obj, size_t len);
 obj_t* obj_string_const_new(const char* str);
 obj_t* obj_string_new(char* str);
 obj_t* obj_string_nocopy_new(char* str);
-obj_t* obj_array_new(val_t* data, size_t length);
+obj_t* obj_array_new(size_t length);
 obj_t* obj_class_new(int fields);
+void obj_array_push(obj_t* obj, val_t val);
 void obj_free(obj_t* obj);
+void obj_evacuate(obj_t* obj);
+size_t obj_size(obj_t* obj);
 
 // Util
 
@@ -141,6 +174,10 @@ void obj_free(obj_t* obj);
 #define COPY_VAL(p) (val_copy(p))
 #define COPY_OBJ(p) (obj_copy(p))
 
+// Ownership
+#define RETAIN_VAL(p) do { if(IS_OBJ(p)) AS_OBJ(p)->refs++; } while(0)
+#define RELEASE_VAL(p) do { if(IS_OBJ(p)) AS_OBJ(p)->refs--; } while(0)
+
 bool val_is_int32(val_t val);
 val_t val_of_int32(int32_t i);
 int val_to_int32(val_t val);
@@ -1,5 +1,14 @@
 // Copyright (C) 2017 Alexander Koch
+#include <stdlib.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "vm.h"
+#include "jit.h"
+#include "parmark.h"
+#include "heap.h"
+#include "pool.h"
+#include <limits.h>
 
 void vm_gc(vm_t* vm);
 
@@ -68,10 +77,351 @@ static gvm_c_function system_methods[] = {
     0
 };
 
+// Number of arguments of the system methods
+static int system_args[] = {
+    1, 1, 0, 1, 0, 0, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 0,
+    1, 3
+};
+
+int vm_syscall_args(int index) {
+    return system_args[index];
+}
+
+void vm_syscall(vm_t* vm, int index) {
+    system_methods[index](vm);
+}
+
+// Changes the stack height, that an instruction causes
+int vm_stack_effect(code_t* code) {
+    switch(code->op) {
+        case OP_PUSH:
+        case OP_PUSHK:
+        case OP_LOAD:
+        case OP_GLOAD:
+        case OP_LDARG0:
+        case OP_UPVAL:
+        case OP_CLASS: return 1;
+        case OP_POP:
+        case OP_STORE:
+        case OP_GSTORE:
+        case OP_SETARG0:
+        case OP_JMPF:
+        case OP_UPSTORE:
+        case OP_SETFIELD:
+        case OP_GETSUB:
+        case OP_AGETSUB:
+        case OP_SGETSUB:
+        case OP_APPEND:
+        case OP_AAPPEND:
+        case OP_SAPPEND:
+        case OP_CONS:
+        case OP_MCONS: return -1;
+        case OP_SETSUB:
+        case OP_MSETSUB: return -2;
+        case OP_RESERVE: return code->a;
+        case OP_ARR:
+        case OP_STR: return 1 - code->a;
+        case OP_INVOKE: return 1 - code->b;
+        case OP_SYSCALL: return 1 - vm_syscall_args(code->a);
+        case OP_HLT:
+        case OP_RET:
+        case OP_RETVIRTUAL:
+        case OP_JMP:
+        case OP_LDLIB:
+        case OP_TOSTR:
+        case OP_LEN:
+        case OP_ALEN:
+        case OP_SLEN:
+        case OP_GETFIELD:
+        case OP_BITNOT:
+        case OP_IMINUS:
+        case OP_I2F:
+        case OP_FMINUS:
+        case OP_F2I:
+        case OP_NOT:
+        case OP_B2I: return 0;
+        default: {
+            // Binary operations
+            if(code->op >= OP_IADD && code->op <= OP_BITXOR) return -1;
+            if(code->op >= OP_FADD && code->op <= OP_FDIV) return -1;
+            if(code->op >= OP_BEQ && code->op <= OP_BOR) return -1;
+            return 0;
+        }
+    }
+}
+
+// Stack height after the instruction, register instructions set it to h
+int vm_stack_after(code_t* code, int height) {
+    if(code->op >= OP_RMOV && code->op <= OP_RIGEKJ) return code->h;
+    return height + vm_stack_effect(code);
+}
+
+// Instructions that can follow the instruction at @pc, returns their count
+int vm_successors(code_t* code, int pc, int* next) {
+    switch(code->op) {
+        case OP_HLT:
+        case OP_RET:
+        case OP_RETVIRTUAL:
+        case OP_RRET: return 0;
+        case OP_JMP: next[0] = code->a; return 1;
+        case OP_JMPF: next[0] = code->a; next[1] = pc + 1; return 2;
+        case OP_RJMPF: next[0] = code->b; next[1] = pc + 1; return 2;
+        default: {
+            if(code->op >= OP_RIEQJ && code->op <= OP_RIGEKJ) {
+                next[0] = code->c;
+                next[1] = pc + 1;
+                return 2;
+            }
+            next[0] = pc + 1;
+            return 1;
+        }
+    }
+}
+
+// Computes the stack height (sp - fp) of every instruction (-1 if unreachable).
+// Returns false, if the height depends on the path to the instruction.
+bool vm_stack_heights(bytecode_t* bytecode, int* height) {
+    size_t len = bytecode->len;
+    size_t top = 0;
+    int* work = malloc(sizeof(int) * len);
+    bool valid = true;
+
+    // Entry points are the program start and every function
+    for(size_t i = 0; i < len; i++) height[i] = -1;
+    height[0] = 0;
+    work[top++] = 0;
+    for(size_t i = 0; i < len; i++) {
+        code_t* code = &bytecode->code[i];
+        if(code->op == OP_INVOKE && height[code->a] == -1) {
+            height[code->a] = 0;
+            work[top++] = code->a;
+        }
+    }
+
+    while(top > 0 && valid) {
+        int pc = work[--top];
+        code_t* code = &bytecode->code[pc];
+        int h = vm_stack_after(code, height[pc]);
+        if(h < 0) {
+            valid = false;
+            break;
+        }
+
+        int next[2];
+        int count = vm_successors(code, pc, next);
+        for(int i = 0; i < count; i++) {
+            int n = next[i];
+            if(n < 0 || (size_t)n >= len) {
+                valid = false;
+            } else if(height[n] == -1) {
+                height[n] = h;
+                work[top++] = n;
+            } else if(height[n] != h) {
+                valid = false;
+            }
+        }
+    }
+
+    free(work);
+    return valid;
+}
+
+// Maximum stack height of the function at @entry.
+// @owner marks the visited instructions with the entry.
+int vm_frame_size(bytecode_t* bytecode, int* height, int* owner, int entry) {
+    size_t top = 0;
+    int* work = malloc(sizeof(int) * bytecode->len);
+    int size = 0;
+
+    owner[entry] = entry;
+    work[top++] = entry;
+    while(top > 0) {
+        int pc = work[--top];
+        code_t* code = &bytecode->code[pc];
+        int h = vm_stack_after(code, height[pc]);
+        if(height[pc] > size) size = height[pc];
+        if(h > size) size = h;
+
+        int next[2];
+        int count = vm_successors(code, pc, next);
+        for(int i = 0; i < count; i++) {
+            if(owner[next[i]] != entry) {
+                owner[next[i]] = entry;
+                work[top++] = next[i];
+            }
+        }
+    }
+
+    free(work);
+    return size;
+}
+
+// Stores the stack size of every called function in its invoke instructions (c),
+// so that invoke only has to check the stack once per frame.
+// Returns the stack size of the program, sizes of STACK_SIZE or more overflow.
+// Returns -1, if the heights are unknown, the pushes have to be checked then.
+int vm_frame_sizes(bytecode_t* bytecode) {
+    size_t len = bytecode->len;
+    int* height = malloc(sizeof(int) * len);
+    bool valid = vm_stack_heights(bytecode, height);
+    int* owner = malloc(sizeof(int) * len);
+    int* size = malloc(sizeof(int) * len);
+    for(size_t i = 0; i < len; i++) {
+        owner[i] = -1;
+        size[i] = -1;
+    }
+
+    for(size_t i = 0; i < len; i++) {
+        code_t* code = &bytecode->code[i];
+        if(code->op != OP_INVOKE) continue;
+        if(!valid) {
+            code->c = 0;
+        } else {
+            if(size[code->a] == -1) {
+                size[code->a] = vm_frame_size(bytecode, height, owner, code->a);
+            }
+            code->c = size[code->a];
+        }
+    }
+
+    int result = valid ? vm_frame_size(bytecode, height, owner, 0) : -1;
+    free(height);
+    free(owner);
+    free(size);
+    return result;
+}
+
+// Local variables read and written by an instruction.
+// Changes the live variables after the instruction (@live) into the ones before it.
+void vm_live_before(code_t* code, int height, uint64_t* live, int words) {
+    #define LIVE_USE(i) if((i) >= 0 && (i) < words * 64) live[(i) / 64] |= (uint64_t)1 << ((i) % 64)
+    #define LIVE_DEF(i) if((i) >= 0 && (i) < words * 64) live[(i) / 64] &= ~((uint64_t)1 << ((i) % 64))
+
+    int op = code->op;
+    switch(op) {
+        case OP_LOAD: LIVE_USE(code->a); break;
+        case OP_STORE: LIVE_DEF(code->a); break;
+        case OP_RESERVE: {
+            // New variables are cleared, freed ones are not read anymore
+            int from = code->a > 0 ? height : height + code->a;
+            int to = code->a > 0 ? height + code->a : height;
+            for(int i = from; i < to; i++) LIVE_DEF(i);
+            break;
+        }
+        case OP_RMOV: LIVE_DEF(code->a); LIVE_USE(code->b); break;
+        case OP_RMOVG:
+        case OP_RMOVK: LIVE_DEF(code->a); break;
+        case OP_RJMPF:
+        case OP_RRET: LIVE_USE(code->a); break;
+        default: {
+            if((op >= OP_RIADD && op <= OP_RIGE) || (op >= OP_RFADD && op <= OP_RFGE)) {
+                LIVE_DEF(code->a);
+                LIVE_USE(code->b);
+                LIVE_USE(code->c);
+            } else if(op >= OP_RIADDK && op <= OP_RIGEK) {
+                LIVE_DEF(code->a);
+                LIVE_USE(code->b);
+            } else if(op >= OP_RIEQJ && op <= OP_RIGEJ) {
+                LIVE_USE(code->a);
+                LIVE_USE(code->b);
+            } else if(op >= OP_RIEQKJ && op <= OP_RIGEKJ) {
+                LIVE_USE(code->a);
+            }
+            break;
+        }
+    }
+
+    #undef LIVE_USE
+    #undef LIVE_DEF
+}
+
+// Computes the local variables of the caller, that are read after each call returns
+// (backwards liveness over the instructions, a call continues at the next instruction).
+// Variables of the upper scopes (upval, upstore) can be read by any callee, they are always live.
+// Returns false, if the stack heights are unknown, no maps are created then.
+bool vm_stack_maps(bytecode_t* bytecode, vm_stackmap_t* maps) {
+    size_t len = bytecode->len;
+    int* height = malloc(sizeof(int) * len);
+    maps->index = 0;
+    maps->bits = 0;
+    maps->words = 0;
+    if(!vm_stack_heights(bytecode, height)) {
+        free(height);
+        return false;
+    }
+
+    int slots = 1;
+    for(size_t i = 0; i < len; i++) {
+        if(height[i] == -1) continue;
+        int h = vm_stack_after(&bytecode->code[i], height[i]);
+        if(height[i] >= slots) slots = height[i] + 1;
+        if(h >= slots) slots = h + 1;
+    }
+    int words = (slots + 63) / 64;
+
+    uint64_t* pinned = calloc(words, sizeof(uint64_t));
+    for(size_t i = 0; i < len; i++) {
+        code_t* code = &bytecode->code[i];
+        if((code->op == OP_UPVAL || code->op == OP_UPSTORE) && code->b >= 0 && code->b < words * 64) {
+            pinned[code->b / 64] |= (uint64_t)1 << (code->b % 64);
+        }
+    }
+
+    // Live variables before every instruction, until nothing changes
+    uint64_t* live = calloc(len * words, sizeof(uint64_t));
+    uint64_t out[words];
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(size_t i = len; i-- > 0;) {
+            if(height[i] == -1) continue;
+            code_t* code = &bytecode->code[i];
+            int next[2];
+            int count = vm_successors(code, (int)i, next);
+            memset(out, 0, sizeof(out));
+            for(int j = 0; j < count; j++) {
+                if(next[j] < 0 || (size_t)next[j] >= len) continue;
+                for(int w = 0; w < words; w++) out[w] |= live[next[j] * words + w];
+            }
+
+            vm_live_before(code, height[i], out, words);
+            if(memcmp(out, &live[i * words], sizeof(out))) {
+                memcpy(&live[i * words], out, sizeof(out));
+                changed = true;
+            }
+        }
+    }
+
+    // The map of a call are the live variables after it
+    int calls = 0;
+    for(size_t i = 0; i + 1 < len; i++) {
+        if(bytecode->code[i].op == OP_INVOKE && height[i] != -1) calls++;
+    }
+    maps->index = malloc(sizeof(int) * len);
+    maps->bits = malloc(sizeof(uint64_t) * (calls > 0 ? calls * words : 1));
+    maps->words = words;
+    int offset = 0;
+    for(size_t i = 0; i < len; i++) {
+        maps->index[i] = -1;
+        if(bytecode->code[i].op != OP_INVOKE || height[i] == -1 || i + 1 >= len) continue;
+        maps->index[i] = offset;
+        for(int w = 0; w < words; w++) {
+            maps->bits[offset + w] = live[(i + 1) * words + w] | pinned[w];
+        }
+        offset += words;
+    }
+
+    free(live);
+    free(pinned);
+    free(height);
+    return true;
+}
+
 void vm_clear(vm_t* vm);
 
 #define VM_ASSERT(x, msg) \
-    if(!(x)) { vm_throw(vm, msg); goto *dispatch_table[OP_HLT]; }
+    if(!(x)) { SAVE_STATE(); vm_throw(vm, msg); goto *dispatch_table[OP_HLT]; }
 
 void vm_throw(vm_t* vm, const char* format, ...) {
     printf("=> Exception thrown: ");
@@ -85,28 +435,102 @@ void vm_throw(vm_t* vm, const char* format, ...) {
     vm->pc = vm->errjmp;
 }
 
-void mark(val_t v) {
-    if(IS_OBJ(v)) {
-        obj_t* obj = AS_OBJ(v);
-        if(!obj->marked) {
-            obj->marked = 1;
+// Marking uses an explicit stack (vm->grey), so nested data does not grow the C stack.
+// Objects on the stack are marked, their fields are scanned in chunks of MARK_CHUNK:
+// the rest of a large array stays below its children, which keeps the stack small.
+
+// Objects, that are marked: the whole heap (vm_gc), the nursery (vm_gc_minor)
+// or the old objects (incremental marking)
+typedef enum {
+    MARK_ALL,
+    MARK_YOUNG,
+    MARK_OLD
+} mark_gen_t;
+
+// Pushes an object, whose fields have to be scanned
+void markPush(vm_t* vm, obj_t* obj) {
+    if(vm->numGrey >= vm->capGrey) {
+        vm->capGrey = (vm->capGrey < 64) ? 64 : vm->capGrey * 2;
+        vm->grey = realloc(vm->grey, sizeof(gc_grey_t) * vm->capGrey);
+    }
+    PREFETCH(obj->data);
+    vm->grey[vm->numGrey++] = (gc_grey_t){obj, 0};
+}
 
-            switch(obj->type) {
-                case OBJ_CLASS: {
-                    obj_class_t* cls = obj->data;
-                    for(unsigned int i = 0; i < cls->field_count; i++) {
-                        mark(cls->fields[i]);
-                    }
-                    break;
-                }
-                case OBJ_ARRAY: {
-                    obj_array_t* arr = obj->data;
-                    for(size_t i = 0; i < arr->len; i++) {
-                        mark(arr->data[i]);
-                    }
-                    break;
-                }
-                default: break;
+void mark(vm_t* vm, val_t v, mark_gen_t gen) {
+    if(!IS_OBJ(v)) return;
+    obj_t* obj = AS_OBJ(v);
+    if(heap_marked(obj)) return;
+    if(gen != MARK_ALL && obj->young != (gen == MARK_YOUNG)) return;
+
+    heap_mark(obj);
+    if(!obj->young) vm->markedBytes += obj_size(obj);
+    if(obj->type == OBJ_ARRAY || obj->type == OBJ_CLASS) {
+        markPush(vm, obj);
+    }
+}
+
+// Scans up to @limit fields of the object on top of the mark stack, returns the scanned count
+size_t markChunk(vm_t* vm, mark_gen_t gen, size_t limit) {
+    gc_grey_t* grey = &vm->grey[vm->numGrey - 1];
+    obj_t* obj = grey->obj;
+    val_t* fields;
+    size_t to;
+    if(obj->type == OBJ_CLASS) {
+        fields = ((obj_class_t*)obj->data)->fields;
+        to = ((obj_class_t*)obj->data)->field_count;
+    } else {
+        fields = ((obj_array_t*)obj->data)->data;
+        to = ((obj_array_t*)obj->data)->len;
+    }
+
+    size_t from = grey->next;
+    if(to - from > limit) {
+        to = from + limit;
+        grey->next = to;
+    } else {
+        // Popped before its fields are pushed
+        vm->numGrey--;
+    }
+
+    for(size_t i = from; i < to; i++) {
+        if(i + MARK_PREFETCH < to && IS_OBJ(fields[i + MARK_PREFETCH])) {
+            PREFETCH(AS_OBJ(fields[i + MARK_PREFETCH]));
+        }
+        mark(vm, fields[i], gen);
+    }
+    return to - from;
+}
+
+// Scans the objects above @base (entries below belong to a running incremental marking)
+void markDrain(vm_t* vm, int base, mark_gen_t gen) {
+    while(vm->numGrey > base) {
+        markChunk(vm, gen, MARK_CHUNK);
+    }
+}
+
+// Clears the local variables of the calling frames, that are not read after their call returns
+// (see vm_stack_maps), so they are no roots. The frame of the top-level code holds the globals
+// and the running frame has no map, both are kept.
+// The slots are owned by their frame: the reference is released, so that a remaining holder
+// of the value can modify it without a copy. Pending operands were retained on the call.
+void clearDeadLocals(vm_t* vm) {
+    vm_stackmap_t* maps = &vm->maps;
+    if(!maps->index) return;
+
+    for(int i = 1; i < vm->depth; i++) {
+        val_t* callee = vm->stack + vm->bases[i];
+        int fp = AS_INT32(callee[-2]);
+        int map = maps->index[AS_INT32(callee[-1]) - 1];
+        if(map < 0) continue;
+
+        uint64_t* live = &maps->bits[map];
+        int locals = vm->frames[i] - fp;
+        if(locals > maps->words * 64) locals = maps->words * 64;
+        for(int j = 0; j < locals; j++) {
+            if(!(live[j / 64] & ((uint64_t)1 << (j % 64)))) {
+                RELEASE_VAL(vm->stack[fp + j]);
+                vm->stack[fp + j] = NULL_VAL;
             }
         }
     }
@@ -114,28 +538,64 @@ void mark(val_t v) {
 
 void markAll(vm_t* vm) {
     for(int i = 0; i < vm->sp; i++) {
-        mark(vm->stack[i]);
+        mark(vm, vm->stack[i], MARK_ALL);
     }
+    markDrain(vm, 0, MARK_ALL);
 }
 
-void sweep(vm_t* vm) {
-    obj_t** val = &vm->firstVal;
-    while(*val) {
-        if(!(*val)->marked) {
-            obj_t* unreached = *val;
-            *val = unreached->next;
-            obj_free(unreached);
-            unreached = 0;
-            vm->numObjects--;
+// Sweeps the nursery, survivors are promoted to the old objects.
+// During incremental marking survivors are black, they were not reachable at its start
+// (their bytes are counted as marked).
+// Survivors on pages, that are not swept yet, stay marked, so that the sweep keeps them.
+void sweepYoung(vm_t* vm) {
+    for(int i = 0; i < vm->young.num; i++) {
+        obj_t* obj = vm->young.objs[i];
+        if(!heap_marked(obj)) {
+            obj_free(obj);
+            continue;
         }
-        else {
-            (*val)->marked = 0;
-            val = &(*val)->next;
+
+        size_t size = obj_size(obj);
+        vm->numObjects++;
+        vm->heapBytes += size;
+        if(vm->gcPhase == GC_MARK) vm->markedBytes += size;
+        obj->young = 0;
+        heap_set_old(obj);
+        if(vm->gcPhase != GC_MARK && !heap_unswept(obj)) {
+            heap_unmark(obj);
         }
     }
+    vm->young.num = 0;
+    vm->youngCounted = 0;
+    vm->youngBytes = 0;
+
+    // Old objects can only reference old objects now
+    for(int i = 0; i < vm->numRemembered; i++) {
+        vm->remembered[i]->remembered = 0;
+    }
+    vm->numRemembered = 0;
 }
 
-void vm_gc(vm_t* vm) {
+// Starts sweeping the pages of the old objects (see vm_gc_step).
+void sweepStart(vm_t* vm) {
+    // Unmarked remembered objects are garbage, they are freed by the sweep
+    int live = 0;
+    for(int i = 0; i < vm->numRemembered; i++) {
+        if(heap_marked(vm->remembered[i])) {
+            vm->remembered[live++] = vm->remembered[i];
+        }
+    }
+    vm->numRemembered = live;
+
+    // The marked objects are the live old objects, the rest is swept
+    vm->heapBytes = vm->markedBytes;
+    heap_sweep_start();
+    vm->gcPhase = GC_SWEEP;
+}
+
+// Marks the whole heap and sweeps the nursery.
+// The old objects are swept lazily, every allocation sweeps a slice of them.
+void gcCollect(vm_t* vm) {
 // Garbage day!
 #ifdef TRACE
     printf("Collecting garbage...\n");
@@ -145,13 +605,141 @@ void vm_gc(vm_t* vm) {
     printf("Beginning objects:%d\n", vm->numObjects);
 #endif
 
-    markAll(vm);
-    sweep(vm);
-    vm->maxObjects = vm->numObjects * 2;
+    // A running collection is finished first
+    if(vm->gcPhase != GC_IDLE) {
+        vm_gc_step(vm, INT_MAX);
+    }
+    vm->markedBytes = 0;
+    clearDeadLocals(vm);
+    int objects = vm->numObjects + vm->young.num;
+    if(vm->gcThreads < 2 || objects < vm->gcParallelMin || !parmark_run(vm, vm->gcThreads)) {
+        markAll(vm);
+    }
+    sweepStart(vm);
+    sweepYoung(vm);
+}
+
+// Collects the whole heap at once
+void vm_gc(vm_t* vm) {
+    gcCollect(vm);
+    vm_gc_step(vm, INT_MAX);
+}
+
+// Minor collection, only the nursery is collected.
+// Roots are the stack and the fields of the remembered objects.
+void vm_gc_minor(vm_t* vm) {
+#ifdef TRACE
+    printf("Collecting young garbage...\n");
+#endif
+
+    int base = vm->numGrey;
+    clearDeadLocals(vm);
+    for(int i = 0; i < vm->sp; i++) {
+        mark(vm, vm->stack[i], MARK_YOUNG);
+    }
+    for(int i = 0; i < vm->numRemembered; i++) {
+        markPush(vm, vm->remembered[i]);
+    }
+    markDrain(vm, base, MARK_YOUNG);
+    sweepYoung(vm);
+}
+
+// Incremental collection of the old objects.
+// Marking starts with the stack and keeps everything, that was reachable at the start
+// (snapshot at the beginning): replaced values are marked by the write barrier and
+// objects promoted in the meantime are black. Young objects are left to vm_gc_minor.
+// The stack is not traced during marking, so the pause of a slice does not depend on the heap size.
+
+// The nursery has been collected, all objects on the stack are old.
+void gcStart(vm_t* vm) {
+#ifdef TRACE
+    printf("Starting incremental collection...\n");
+#endif
+
+    vm->gcPhase = GC_MARK;
+    vm->markedBytes = 0;
+    clearDeadLocals(vm);
+    for(int i = 0; i < vm->sp; i++) {
+        mark(vm, vm->stack[i], MARK_OLD);
+    }
+}
+
+// Scans grey objects, large arrays are split over several slices.
+// Returns the remaining budget.
+int markSlice(vm_t* vm, int budget) {
+    while(vm->numGrey > 0 && budget > 0) {
+        size_t limit = (budget < MARK_CHUNK) ? (size_t)budget : MARK_CHUNK;
+        budget -= (int)markChunk(vm, MARK_OLD, limit) + 1;
+    }
+    return budget;
+}
+
+// Sweeps pages, until the freed objects exceed the budget
+int sweepSlice(vm_t* vm, int budget) {
+    while(heap_sweeping() && budget > 0) {
+        size_t freed = heap_sweep_page();
+        vm->numObjects -= freed;
+        budget -= (int)freed + 1;
+    }
+    return budget;
+}
+
+// Sets the bytes of the old objects, that start the next full collection
+void gcPace(vm_t* vm) {
+    double target = (double)vm->heapBytes * vm->heapGrowth;
+    if(target < (double)vm->heapInitial) target = (double)vm->heapInitial;
+    if(vm->heapMax > 0 && target > (double)vm->heapMax) target = (double)vm->heapMax;
+    vm->heapTarget = (size_t)target;
+}
+
+// Compacts the payloads after a full collection: the few chunks left in sparse pool pages
+// are moved to other pages, so that the pages are released (see pool.h).
+// Headers stay in place, values reference them. The free memory of malloc is returned.
+void gcCompact(vm_t* vm) {
+    if(pool_evacuate_start() > 0) {
+        heap_each(obj_evacuate);
+        pool_evacuate_end();
+    }
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+// Runs a slice of the incremental collection or of the lazy sweep,
+// @budget limits the scanned fields and swept objects.
+void vm_gc_step(vm_t* vm, int budget) {
+    if(vm->gcPhase == GC_MARK) {
+        budget = markSlice(vm, budget);
+        if(vm->numGrey > 0) return;
+        sweepStart(vm);
+    }
 
+    if(vm->gcPhase == GC_SWEEP) {
+        sweepSlice(vm, budget);
+        if(heap_sweeping()) return;
+
+        vm->gcPhase = GC_IDLE;
+        gcPace(vm);
+        if(vm->gcCompact) gcCompact(vm);
 #ifdef TRACE_STEP
-    printf("New objects:%d\n", vm->numObjects);
+        printf("New objects:%d (%zu bytes)\n", vm->numObjects, vm->heapBytes);
 #endif
+    }
+}
+
+// Write barrier, has to be called when @val replaces @old in the object @obj.
+// Old objects referencing young objects are remembered for the next minor collection.
+// During incremental marking the replaced value is marked (see gcStart).
+void vm_write_barrier(vm_t* vm, obj_t* obj, val_t old, val_t val) {
+    if(vm->gcPhase == GC_MARK) mark(vm, old, MARK_OLD);
+    if(obj->young || obj->remembered || !IS_OBJ(val) || !AS_OBJ(val)->young) return;
+
+    if(vm->numRemembered >= vm->capRemembered) {
+        vm->capRemembered = (vm->capRemembered < 16) ? 16 : vm->capRemembered * 2;
+        vm->remembered = realloc(vm->remembered, sizeof(obj_t*) * vm->capRemembered);
+    }
+    obj->remembered = 1;
+    vm->remembered[vm->numRemembered++] = obj;
 }
 
 void vm_push(vm_t* vm, val_t val) {
@@ -167,85 +755,123 @@ val_t vm_pop(vm_t* vm) {
     return vm->stack[--vm->sp];
 }
 
-void val_append(vm_t* vm, val_t v1);
+// Safepoint of the collector after an allocation, new objects are registered by obj_new
+// and have to be reachable from the stack (vm->sp) now.
+// The nursery is collected, when it is full (objects or bytes).
+// The whole heap is collected, when the old objects exceed their target (see gcPace).
+// Every allocation does a slice of the sweep (and of the marking in incremental mode).
+void vm_gc_poll(vm_t* vm) {
+    if(vm->gcPhase != GC_IDLE) {
+        vm_gc_step(vm, (vm->gcSlice > 0) ? vm->gcSlice : GC_SLICE);
+    }
+    while(vm->youngCounted < vm->young.num) {
+        vm->youngBytes += obj_size(vm->young.objs[vm->youngCounted++]);
+    }
+    if(vm->young.num >= NURSERY_SIZE || vm->youngBytes >= NURSERY_BYTES) {
+        vm_gc_minor(vm);
+        if(vm->gcPhase == GC_IDLE && vm->heapBytes >= vm->heapTarget) {
+            if(vm->gcSlice > 0) {
+                gcStart(vm);
+            } else {
+                gcCollect(vm);
+            }
+        }
+    }
+}
 
-void obj_append(vm_t* vm, obj_t* obj) {
-    if(vm->numObjects >= vm->maxObjects) {
-        vm_gc(vm);
+// Reads a size in bytes with an optional K, M or G suffix from the environment
+static void gcEnvSize(const char* name, size_t* size) {
+    const char* str = getenv(name);
+    if(!str) return;
+
+    char* end;
+    double value = strtod(str, &end);
+    switch(*end) {
+        case 'K': case 'k': value *= 1024.0; end++; break;
+        case 'M': case 'm': value *= 1024.0 * 1024.0; end++; break;
+        case 'G': case 'g': value *= 1024.0 * 1024.0 * 1024.0; end++; break;
+        default: break;
+    }
+    if(end == str || *end != '\0' || value < 0.0) {
+        printf("Invalid value of %s: '%s', using the default\n", name, str);
+        return;
     }
+    *size = (size_t)value;
+}
 
-    obj->marked = 0;
-    obj->next = vm->firstVal;
-    vm->firstVal = obj;
-    vm->numObjects++;
+// Sets the pacing of the full collections, the defaults are changed by the environment
+// (see GC_HEAP_INITIAL). The growth factor is at least 1.
+void vm_gc_config(vm_t* vm) {
+    vm->heapInitial = GC_HEAP_INITIAL;
+    vm->heapGrowth = GC_HEAP_GROWTH;
+    vm->heapMax = 0;
+    gcEnvSize("GOLEM_GC_INITIAL", &vm->heapInitial);
+    gcEnvSize("GOLEM_GC_MAX", &vm->heapMax);
+
+    const char* compact = getenv("GOLEM_GC_COMPACT");
+    vm->gcCompact = true;
+    if(compact) {
+        if(!strcmp(compact, "0")) {
+            vm->gcCompact = false;
+        } else if(strcmp(compact, "1")) {
+            printf("Invalid value of GOLEM_GC_COMPACT: '%s', using the default\n", compact);
+        }
+    }
 
-    // If the objects are containers, check their content
-    switch(obj->type) {
-        case OBJ_ARRAY: {
-            obj_array_t* arr = obj->data;
-            for(size_t i = arr->len; i != 0; i--) {
-                val_append(vm, arr->data[i-1]);
-            }
-            break;
+    // The marking threads are set for tests, so small heaps are marked in parallel as well
+    const char* threads = getenv("GOLEM_GC_THREADS");
+    vm->gcParallelMin = PARMARK_MIN_OBJECTS;
+    if(threads) {
+        char* end;
+        long value = strtol(threads, &end, 10);
+        if(end == threads || *end != '\0' || value < 1 || value > PARMARK_THREADS) {
+            printf("Invalid value of GOLEM_GC_THREADS: '%s', using the default\n", threads);
+        } else {
+            vm->gcThreads = (int)value;
+            vm->gcParallelMin = 0;
         }
-        case OBJ_CLASS: {
-            obj_class_t* cls = obj->data;
-            for(size_t i = 0; i < cls->field_count; i++) {
-                val_append(vm, cls->fields[i]);
-            }
-            break;
+    }
+
+    const char* growth = getenv("GOLEM_GC_GROWTH");
+    if(growth) {
+        char* end;
+        double value = strtod(growth, &end);
+        if(end == growth || *end != '\0' || value < 1.0) {
+            printf("Invalid value of GOLEM_GC_GROWTH: '%s', using the default\n", growth);
+        } else {
+            vm->heapGrowth = value;
         }
-        default: break;
     }
-}
 
-// Append a value to the GC system
-void val_append(vm_t* vm, val_t v1) {
-    if(IS_OBJ(v1)) {
-        obj_append(vm, AS_OBJ(v1));
+    vm->heapTarget = vm->heapInitial;
+    if(vm->heapMax > 0 && vm->heapTarget > vm->heapMax) {
+        vm->heapTarget = vm->heapMax;
     }
 }
 
-// Push and register in GC, if v1 is a ptr
+// Pushes a new value and polls the collector
 void vm_register(vm_t* vm, val_t v1) {
     vm_push(vm, v1);
-    val_append(vm, v1);
+    vm_gc_poll(vm);
 }
 
 // Just prints out instruction codes
-void vm_print_code(vm_t* vm, vector_t* buffer) {
+void vm_print_code(vm_t* vm, bytecode_t* bytecode) {
     vm->pc = 0;
     printf("\nImmediate code:\n");
 
-    instruction_t* instr = vector_get(buffer, vm->pc);
-    while(instr->op != OP_HLT) {
-        printf("  %.2d: %s", vm->pc, op2str(instr->op));
-        if(instr->v1 != NULL_VAL) {
-            printf(", ");
-            val_print(instr->v1);
-        }
-        if(instr->v2 != NULL_VAL) {
-            printf(", ");
-            val_print(instr->v2);
-        }
+    while(bytecode->code[vm->pc].op != OP_HLT) {
+        printf("  %.2d: ", vm->pc);
+        bytecode_print(bytecode, vm->pc);
         putchar('\n');
-
         vm->pc++;
-        instr = vector_get(buffer, vm->pc);
     }
     vm->pc = 0;
 }
 
-void vm_trace_print(vm_t* vm, instruction_t* instr) {
-    printf("  %.2d (SP:%.2d, FP:%.2d): %s", vm->pc, vm->sp, vm->fp, op2str(instr->op));
-    if(instr->v1 != NULL_VAL) {
-        printf(", ");
-        val_print(instr->v1);
-    }
-    if(instr->v2 != NULL_VAL) {
-        printf(", ");
-        val_print(instr->v2);
-    }
+void vm_trace_print(vm_t* vm, bytecode_t* bytecode) {
+    printf("  %.2d (SP:%.2d, FP:%.2d): ", vm->pc-1, vm->sp, vm->fp);
+    bytecode_print(bytecode, vm->pc-1);
     printf(" => STACK [");
 
     //int begin = vm->sp - 8;
@@ -267,6 +893,22 @@ void vm_trace_print(vm_t* vm, instruction_t* instr) {
 #endif
 }
 
+// Copy-on-write:
+// Returns the object, if it has no more than @owners owners,
+// otherwise a copy is returned, that can be modified in place.
+// The copy is young, the caller polls the collector (vm_gc_poll), once it is on the stack.
+obj_t* vm_unshare(vm_t* vm, obj_t* obj, int owners) {
+    if(obj->refs <= owners) return obj;
+    return COPY_OBJ(obj);
+}
+
+// Stores a value in a slot that owns it (variable, argument).
+void vm_store(val_t* slot, val_t val) {
+    RETAIN_VAL(val);
+    RELEASE_VAL(*slot);
+    *slot = val;
+}
+
 // Fast, optimized version for vm_register.
 // Use if value needs to be copied and pushed onto the stack.
 void vm_copy(vm_t* vm, val_t val) {
@@ -275,14 +917,75 @@ void vm_copy(vm_t* vm, val_t val) {
         obj_t* newObj = COPY_OBJ(obj);
 
         vm_push(vm, OBJ_VAL(newObj));
-        obj_append(vm, newObj);
+        vm_gc_poll(vm);
     } else {
         vm_push(vm, val);
     }
 }
 
-// Processes a buffer instruction based on instruction / program counter (pc).
-void vm_exec(vm_t* vm, vector_t* buffer) {
+// Replaces the sub-element of an owned string or array.
+void vm_setsub(vm_t* vm, obj_t* obj, int idx, val_t val) {
+    if(obj->type == OBJ_STRING) {
+        char* data = obj->data;
+        // VM_ASSERT(idx >= 0 && idx < strlen(data), "Array index out of bounds");
+        data[idx] = (char)AS_INT32(val);
+    } else {
+        // VM_ASSERT(idx >= 0 && idx < arr->len, "Array index out of bounds");
+        obj_array_t* arr = obj->data;
+        val_t old = arr->data[idx];
+        RETAIN_VAL(val);
+        RELEASE_VAL(old);
+        arr->data[idx] = val;
+        vm_write_barrier(vm, obj, old, val);
+    }
+}
+
+// Appends a value to a string or an array.
+// Arrays are extended in place, if they have no more than @owners owners.
+// A new object is young, the caller polls the collector (see vm_unshare).
+obj_t* vm_cons(vm_t* vm, obj_t* obj, val_t val, int owners) {
+    if(obj->type == OBJ_STRING) {
+        // Allocate len + 2 => one for the char and one for the trailing zero
+        char* str = obj->data;
+        size_t len = strlen(str);
+        char c = (char)AS_INT32(val);
+        obj_t* obj_ptr = obj_string_buffer_new(len+1);
+        char* newStr = obj_ptr->data;
+        memcpy(newStr, str, len);
+        newStr[len] = c;
+        newStr[len+1] = '\0';
+        return obj_ptr;
+    }
+
+    // Copy the array, if it is shared
+    obj = vm_unshare(vm, obj, owners);
+    RETAIN_VAL(val);
+    obj_array_t* arr = obj->data;
+    if(!obj->young && arr->len >= arr->cap) {
+        // Growth of an old array counts for the pacing
+        size_t size = obj_size(obj);
+        obj_array_push(obj, val);
+        vm->heapBytes += obj_size(obj) - size;
+    } else {
+        obj_array_push(obj, val);
+    }
+    vm_write_barrier(vm, obj, NULL_VAL, val);
+    return obj;
+}
+
+// Converts the code into threaded code:
+// every instruction gets the address of its handler and jumps get their target instruction.
+void vm_thread(bytecode_t* bytecode, void** dispatch_table) {
+    for(size_t i = 0; i < bytecode->len; i++) {
+        code_t* code = &bytecode->code[i];
+        int* addr = bytecode_target(code);
+        code->handler = dispatch_table[code->op];
+        code->target = addr ? &bytecode->code[*addr] : 0;
+    }
+}
+
+// Processes packed bytecode based on instruction / program counter (pc).
+void vm_exec(vm_t* vm, bytecode_t* bytecode) {
     static void* dispatch_table[] = {
         &&code_hlt,
         &&code_push,
@@ -350,196 +1053,386 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         &&code_upstore,
         &&code_class,
         &&code_setfield,
-        &&code_getfield
+        &&code_getfield,
+        &&code_msetsub,
+        &&code_mcons,
+        &&code_lliadd,
+        &&code_lkiadd,
+        &&code_lkisub,
+        &&code_linc,
+        &&code_ginc,
+        &&code_iltjmpf,
+        &&code_lkiltjmpf,
+        &&code_ldfield,
+        &&code_rmov,
+        &&code_rmovg,
+        &&code_rmovk,
+        &&code_rjmpf,
+        &&code_riadd,
+        &&code_risub,
+        &&code_rimul,
+        &&code_ridiv,
+        &&code_rmod,
+        &&code_rieq,
+        &&code_rine,
+        &&code_rilt,
+        &&code_rigt,
+        &&code_rile,
+        &&code_rige,
+        &&code_riaddk,
+        &&code_risubk,
+        &&code_rieqk,
+        &&code_rinek,
+        &&code_riltk,
+        &&code_rigtk,
+        &&code_rilek,
+        &&code_rigek,
+        &&code_rfadd,
+        &&code_rfsub,
+        &&code_rfmul,
+        &&code_rfdiv,
+        &&code_rflt,
+        &&code_rfgt,
+        &&code_rfle,
+        &&code_rfge,
+        &&code_rret,
+        &&code_rieqj,
+        &&code_rinej,
+        &&code_riltj,
+        &&code_rigtj,
+        &&code_rilej,
+        &&code_rigej,
+        &&code_rieqkj,
+        &&code_rinekj,
+        &&code_riltkj,
+        &&code_rigtkj,
+        &&code_rilekj,
+        &&code_rigekj,
+        &&code_pushk,
+        &&code_agetsub,
+        &&code_sgetsub,
+        &&code_alen,
+        &&code_slen,
+        &&code_aappend,
+        &&code_sappend
     };
 
     // Set the jmp position if an error occurs
-    vm->errjmp = vector_size(buffer)-1;
+    vm->errjmp = bytecode->len-1;
+    vm_thread(bytecode, dispatch_table);
 
     // Create the tmp instruction
-    instruction_t* instr = 0;
+    code_t* code = bytecode->code;
+    val_t* consts = bytecode->consts;
+    code_t* instr = 0;
+
+    // The registers are kept in locals, they are only written back
+    // at calls, native functions, garbage collection and errors.
+    val_t* stack = vm->stack;
+    code_t* ip = code + vm->pc;
+    val_t* sp = stack + vm->sp;
+    val_t* fp = stack + vm->fp;
+
+    // Code with unknown stack heights is checked before every instruction (see code_checked),
+    // native code assumes the computed stack sizes
+    const bool checked = vm->checked;
+    if(checked) {
+        for(size_t i = 0; i < bytecode->len; i++) {
+            code[i].handler = &&code_checked;
+        }
+    }
+    jit_t* jit = checked ? 0 : vm->jit;
+    if(jit) jit_load(jit, bytecode);
+
+    #define SAVE_STATE() do { \
+        vm->pc = ip - code; \
+        vm->sp = sp - stack; \
+        vm->fp = fp - stack; \
+    } while(0)
+    #define LOAD_STATE() do { \
+        ip = code + vm->pc; \
+        sp = stack + vm->sp; \
+        fp = stack + vm->fp; \
+    } while(0)
+
+    // The collector only marks the stack below vm->sp
+    #define GC_POINT() vm->sp = sp - stack
+
+    // Polls the collector, if the object on top of the stack is a copy of @src (see vm_unshare)
+    #define GC_POLL_COPY(obj, src) do { \
+        if((obj) != (src)) { \
+            GC_POINT(); \
+            vm_gc_poll(vm); \
+        } \
+    } while(0)
+
+    // The stack size of every frame is checked on invoke
+    #define PUSH(v) (*sp++ = (v))
+    #define POP() (*--sp)
+
+    // Removes the current stack frame.
+    // Releases the locals, the arguments and the pending operands of the caller.
+    #define LEAVE() do { \
+        for(val_t* v = fp; v < sp; v++) RELEASE_VAL(*v); \
+        sp = fp; \
+        ip = code + AS_INT32(POP()); \
+        fp = stack + AS_INT32(POP()); \
+        int args = AS_INT32(POP()); \
+        vm->lp = vm->frames[--vm->depth]; \
+        for(val_t* v = stack + vm->lp; v < sp; v++) RELEASE_VAL(*v); \
+        sp -= args; \
+    } while(0)
 
 #ifndef TRACE
-    #define FETCH() instr = buffer->data[vm->pc++]
+    #define FETCH() instr = ip++
 #else
-    #define FETCH() instr = buffer->data[vm->pc++]; \
-        vm_trace_print(vm, instr)
+    #define FETCH() instr = ip++; \
+        SAVE_STATE(); \
+        vm_trace_print(vm, bytecode)
 #endif
 
+#ifdef DB_DISPATCH
+    unsigned long dispatches = 0;
+    #define COUNT() dispatches++
+#else
+    #define COUNT()
+#endif
+
+    // Quickening: generic instructions replace themselves with a specialized
+    // instruction on their first execution. Checked code keeps its handler.
+    #define QUICKEN(quick) do { \
+        instr->op = quick; \
+        if(!checked) instr->handler = dispatch_table[quick]; \
+    } while(0)
+
+    // Specialized instructions check the object type, the operands are objects.
+    // If it does not match, the instruction falls back to a generic handler for good.
+    #define GUARD(val, objtype, generic, label) \
+        if(AS_OBJ(val)->type != objtype) { \
+            instr->op = generic; \
+            if(!checked) instr->handler = &&label; \
+            goto label; \
+        }
+
     // DISPATCH -> jump to pc and increment pc afterwards
     #define DISPATCH() \
         FETCH(); \
-        goto *dispatch_table[instr->op]
+        COUNT(); \
+        goto *instr->handler
 
     // Dispatch and run
     DISPATCH();
-    code_hlt: return;
+    code_hlt: {
+        SAVE_STATE();
+#ifdef DB_DISPATCH
+        printf("Dispatched instructions: %lu\n", dispatches);
+#endif
+        return;
+    }
+    code_checked: {
+        // An instruction pushes one value at most, reserve pushes the new variables
+        int pushed = (instr->op == OP_RESERVE && instr->a > 0) ? instr->a : 1;
+        if(sp + pushed > stack + STACK_SIZE) {
+            SAVE_STATE();
+            vm_throw(vm, "Stack overflow");
+            LOAD_STATE();
+            DISPATCH();
+        }
+        goto *dispatch_table[instr->op];
+    }
     code_push: {
-        vm_copy(vm, instr->v1);
+        // Quickened on the first execution.
+        // Constant objects are pinned, the constant table is counted as an owner,
+        // so they are copied on modification (see vm_unshare) instead of on every push.
+        val_t val = consts[instr->a];
+        RETAIN_VAL(val);
+        QUICKEN(OP_PUSHK);
+        PUSH(val);
+        DISPATCH();
+    }
+    code_pushk: {
+        PUSH(consts[instr->a]);
         DISPATCH();
     }
     code_pop: {
-        vm_pop(vm);
+        sp--;
         DISPATCH();
     }
     code_store: {
-        int offset = AS_INT32(instr->v1);
-        vm->stack[vm->fp+offset] = vm_pop(vm);
+        int offset = instr->a;
+        vm_store(&fp[offset], POP());
         DISPATCH();
     }
     code_load: {
-        int offset = AS_INT32(instr->v1);
-        vm_copy(vm, vm->stack[vm->fp+offset]);
+        // Values are shared, copies are made on modification
+        int offset = instr->a;
+        PUSH(fp[offset]);
         DISPATCH();
     }
     code_gstore: {
-        int offset = AS_INT32(instr->v1);
-        vm->stack[offset] = vm_pop(vm);
+        int offset = instr->a;
+        vm_store(&stack[offset], POP());
         DISPATCH();
     }
     code_gload: {
-        int offset = AS_INT32(instr->v1);
-        vm_copy(vm, vm->stack[offset]);
+        int offset = instr->a;
+        PUSH(stack[offset]);
         DISPATCH();
     }
     code_ldarg0: {
-        int args = AS_INT32(vm->stack[vm->fp-3]);
-        vm_copy(vm, vm->stack[vm->fp-args-4]);
+        int args = AS_INT32(fp[-3]);
+        PUSH(fp[-args-4]);
         DISPATCH();
     }
     code_setarg0: {
-        int args = AS_INT32(vm->stack[vm->fp-3]);
-        vm->stack[vm->fp-args-4] = vm_pop(vm);
+        int args = AS_INT32(fp[-3]);
+        vm_store(&fp[-args-4], POP());
         DISPATCH();
     }
     code_iadd: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 + v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 + v2));
         DISPATCH();
     }
     code_isub: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 - v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 - v2));
         DISPATCH();
     }
     code_imul: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 * v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 * v2));
         DISPATCH();
     }
     code_idiv: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 / v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 / v2));
         DISPATCH();
     }
     code_mod: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 % v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 % v2));
         DISPATCH();
     }
     code_bitl: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 << v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 << v2));
         DISPATCH();
     }
     code_bitr: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 >> v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 >> v2));
         DISPATCH();
     }
     code_bitand: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 & v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 & v2));
         DISPATCH();
     }
     code_bitor: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 | v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 | v2));
         DISPATCH();
     }
     code_bitxor: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(v1 ^ v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(v1 ^ v2));
         DISPATCH();
     }
     code_bitnot: {
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(~v1));
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(~v1));
         DISPATCH();
     }
     code_iminus: {
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, INT32_VAL(-v1));
+        int v1 = AS_INT32(POP());
+        PUSH(INT32_VAL(-v1));
         DISPATCH();
     }
     code_i2f: {
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, NUM_VAL(v1));
+        int v1 = AS_INT32(POP());
+        PUSH(NUM_VAL(v1));
         DISPATCH();
     }
     code_fadd: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, NUM_VAL(v1 + v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(NUM_VAL(v1 + v2));
         DISPATCH();
     }
     code_fsub: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, NUM_VAL(v1 - v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(NUM_VAL(v1 - v2));
         DISPATCH();
     }
     code_fmul: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, NUM_VAL(v1 * v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(NUM_VAL(v1 * v2));
         DISPATCH();
     }
     code_fdiv: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, NUM_VAL(v1 / v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(NUM_VAL(v1 / v2));
         DISPATCH();
     }
     code_fminus: {
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, NUM_VAL(-v1));
+        double v1 = AS_NUM(POP());
+        PUSH(NUM_VAL(-v1));
         DISPATCH();
     }
     code_f2i: {
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, INT32_VAL((int)v1));
+        double v1 = AS_NUM(POP());
+        PUSH(INT32_VAL((int)v1));
         DISPATCH();
     }
     code_not: {
-        bool b = AS_BOOL(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(!b));
+        bool b = AS_BOOL(POP());
+        PUSH(BOOL_VAL(!b));
         DISPATCH();
     }
     code_b2i: {
-        bool b = AS_BOOL(vm_pop(vm));
-        vm_push(vm, INT32_VAL(b));
+        bool b = AS_BOOL(POP());
+        PUSH(INT32_VAL(b));
         DISPATCH();
     }
     code_syscall: {
-        int index = AS_INT32(instr->v1);
+        int index = instr->a;
+        SAVE_STATE();
         system_methods[index](vm);
+        LOAD_STATE();
         DISPATCH();
     }
     code_invoke: {
         // Arguments already on the stack
-        int address = AS_INT32(instr->v1);
-        int args = AS_INT32(instr->v2);
+        int args = instr->b;
+
+        // The frame header and the stack size of the function (c) have to fit
+        if(sp + 3 + instr->c > stack + STACK_SIZE) {
+            SAVE_STATE();
+            vm_throw(vm, "Stack overflow");
+            LOAD_STATE();
+            DISPATCH();
+        }
+
+        // The arguments and the pending operands of the caller
+        // are owned by the frame until it returns.
+        for(val_t* v = stack + vm->lp; v < sp; v++) {
+            RETAIN_VAL(*v);
+        }
+        vm->frames[vm->depth++] = vm->lp;
 
         // Arg0 -3
         // Arg1 -2
@@ -548,9 +1441,9 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         // ...  +1
         // ...  +2
 
-        vm_push(vm, INT32_VAL(args));
-        vm_push(vm, INT32_VAL(vm->fp));
-        vm_push(vm, INT32_VAL(vm->pc));
+        PUSH(INT32_VAL(args));
+        PUSH(INT32_VAL(fp - stack));
+        PUSH(INT32_VAL(ip - code));
 
         // |   STACK_BOTTOM      |
         // |...                  |
@@ -559,92 +1452,132 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         // |Arg2               -5|
         // |...                -4|
         // |NUM_ARGS           -3|
-        // |FP                 -2|    <-- vm->fp - 2
+        // |FP                 -2|    <-- fp - 2
         // |PC                 -1|
         // |...                 0|    <-- current position sp / fp
         // |...                +1|
         // |    STACK_TOP        |
 
-        vm->fp = vm->sp;
-        vm->pc = address;
+        vm->lp = sp - stack;
+        vm->bases[vm->depth - 1] = vm->lp;
+
+        // Hot functions run as native code
+        if(jit) {
+            jit_fn_t fn = jit_enter(jit, instr->a);
+            if(fn) {
+                SAVE_STATE();
+                val_t* top = jit_call(vm, fn, sp);
+                if(!top) {
+                    LOAD_STATE();
+                } else {
+                    sp = top;
+                }
+                DISPATCH();
+            }
+        }
+
+        fp = sp;
+        ip = instr->target;
         DISPATCH();
     }
     code_reserve: {
-        vm->sp += AS_INT32(instr->v1);
+        // New variables are cleared, freed ones lose their value
+        int sz = instr->a;
+        if(sz > 0) {
+            for(int i = 0; i < sz; i++) {
+                sp[i] = NULL_VAL;
+            }
+        } else {
+            for(int i = sz; i < 0; i++) {
+                RELEASE_VAL(sp[i]);
+            }
+        }
+        sp += sz;
+        vm->lp = sp - stack;
         DISPATCH();
     }
     code_ret: {
         // Returns to previous instruction pointer,
         // and pushes the return value back on the stack.
         // If you call this function make sure there is a return value on the stack.
-        val_t ret = vm_pop(vm);
+        val_t ret = POP();
 
-        vm->sp = vm->fp;
-        vm->pc = AS_INT32(vm_pop(vm));
-        vm->fp = AS_INT32(vm_pop(vm));
-        vm->sp -= AS_INT32(vm_pop(vm));
-
-        vm_push(vm, ret);
+        LEAVE();
+        PUSH(ret);
         DISPATCH();
     }
     code_retvirtual: {
         // Returns from a virtual class function
-        val_t ret = vm_pop(vm);
+        val_t ret = POP();
 
-        vm->sp = vm->fp;
-        vm->pc = AS_INT32(vm_pop(vm));
-        vm->fp = AS_INT32(vm_pop(vm));
-        vm->sp -= AS_INT32(vm_pop(vm));
-        val_t clazz = vm_pop(vm);
+        LEAVE();
+        val_t clazz = POP();
 
-        vm_push(vm, ret);
-        vm_push(vm, clazz);
+        PUSH(ret);
+        PUSH(clazz);
         DISPATCH();
     }
     code_jmp: {
-        vm->pc = AS_INT32(instr->v1);
+        ip = instr->target;
+
+        // Hot loops run as native traces
+        if(jit && ip <= instr) {
+            jit_trace_fn_t trace = jit_loop(jit, ip - code, &&code_record);
+            if(trace) {
+                SAVE_STATE();
+                jit_trace_call(vm, trace, fp, sp);
+                LOAD_STATE();
+            }
+        }
         DISPATCH();
     }
+    code_record: {
+        // A loop is recorded (see jit_loop)
+        jit_record(vm, instr, sp, fp);
+        goto *dispatch_table[instr->op];
+    }
     code_jmpf: {
-        bool result = AS_BOOL(vm_pop(vm));
+        bool result = AS_BOOL(POP());
         if(!result) {
-            vm->pc = AS_INT32(instr->v1);
+            ip = instr->target;
         }
         DISPATCH();
     }
     code_arr: {
         // Reverse list fetching and inserting.
-        // Copying is not needed, because array consumes all the objects.
-        // The objects already have to be a copy.
-        size_t elsz = AS_INT32(instr->v1);
-        val_t* arr = malloc(sizeof(val_t) * elsz);
+        // Copying is not needed, the array becomes an owner of the objects.
+        size_t elsz = instr->a;
+        obj_t* obj = obj_array_new(elsz);
+        val_t* arr = ((obj_array_t*)obj->data)->data;
         for(int i = elsz; i > 0; i--) {
             // Get index object
-            val_t val = vm->stack[vm->sp - i];
-            arr[elsz - i] = COPY_VAL(val);        // <-- vm_register causes all sub objects also to be appended, therefore error
-            vm->stack[vm->sp - i] = NULL_VAL;
+            val_t val = sp[-i];
+            RETAIN_VAL(val);
+            arr[elsz - i] = val;
+            sp[-i] = NULL_VAL;
         }
-        vm->sp -= elsz;
+        sp -= elsz;
 
-        obj_t* obj = obj_array_new(arr, elsz);
-        vm_push(vm, OBJ_VAL(obj));
-        obj_append(vm, obj);
+        PUSH(OBJ_VAL(obj));
+        GC_POINT();
+        vm_gc_poll(vm);
         DISPATCH();
     }
     code_str: {
-        size_t elsz = AS_INT32(instr->v1);
-        char *str = malloc(sizeof(char) * (elsz+1));
+        size_t elsz = instr->a;
+        obj_t* obj = obj_string_buffer_new(elsz);
+        char *str = obj->data;
 
         for(int i = elsz; i > 0; i--) {
-            val_t val = vm->stack[vm->sp - i];
+            val_t val = sp[-i];
             str[elsz - i] = (char)AS_INT32(val);
-            vm->stack[vm->sp - i] = 0;
+            sp[-i] = 0;
         }
-        vm->sp -= elsz;
+        sp -= elsz;
         str[elsz] = '\0';
-        obj_t* obj = obj_string_nocopy_new(str);
-        vm_push(vm, OBJ_VAL(obj));
-        obj_append(vm, obj);
+        PUSH(OBJ_VAL(obj));
+        GC_POINT();
+        vm_gc_poll(vm);
         DISPATCH();
     }
     code_ldlib: {
@@ -653,7 +1586,7 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         // 1. Test if library is loaded
         // 2. Load library into hashtable
 
-        /*char* path = AS_STRING(instr->v1);
+        /*char* path = AS_STRING(consts[instr->a]);
          shared_lib* lib = hashmap_find(vm->libraries, path);
         if(!lib) {
             shared_lib* lib = calloc(1, sizeof(shared_lib));
@@ -666,105 +1599,107 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         DISPATCH();
     }
     code_tostr: {
-        val_t val = vm_pop(vm);
-        char* str = val_tostr(val);
-        vm_register(vm, STRING_NOCOPY_VAL(str));
+        val_t val = POP();
+        val_t str = STRING_NOCOPY_VAL(val_tostr(val));
+        PUSH(str);
+        GC_POINT();
+        vm_gc_poll(vm);
         DISPATCH();
     }
     code_beq: {
-        bool b2 = AS_BOOL(vm_pop(vm));
-        bool b1 = AS_BOOL(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(b1 == b2));
+        bool b2 = AS_BOOL(POP());
+        bool b1 = AS_BOOL(POP());
+        PUSH(BOOL_VAL(b1 == b2));
         DISPATCH();
     }
     code_ieq: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 == v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(BOOL_VAL(v1 == v2));
         DISPATCH();
     }
     code_feq: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 == v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(BOOL_VAL(v1 == v2));
         DISPATCH();
     }
     code_bne: {
-        bool b2 = AS_BOOL(vm_pop(vm));
-        bool b1 = AS_BOOL(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(b1 != b2));
+        bool b2 = AS_BOOL(POP());
+        bool b1 = AS_BOOL(POP());
+        PUSH(BOOL_VAL(b1 != b2));
         DISPATCH();
     }
     code_ine: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 != v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(BOOL_VAL(v1 != v2));
         DISPATCH();
     }
     code_fne: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 != v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(BOOL_VAL(v1 != v2));
         DISPATCH();
     }
     code_ilt: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 < v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(BOOL_VAL(v1 < v2));
         DISPATCH();
     }
     code_igt: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 > v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(BOOL_VAL(v1 > v2));
         DISPATCH();
     }
     code_ile: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 <= v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(BOOL_VAL(v1 <= v2));
         DISPATCH();
     }
     code_ige: {
-        int v2 = AS_INT32(vm_pop(vm));
-        int v1 = AS_INT32(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 >= v2));
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        PUSH(BOOL_VAL(v1 >= v2));
         DISPATCH();
     }
     code_flt: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 < v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(BOOL_VAL(v1 < v2));
         DISPATCH();
     }
     code_fgt: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 > v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(BOOL_VAL(v1 > v2));
         DISPATCH();
     }
     code_fle: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 <= v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(BOOL_VAL(v1 <= v2));
         DISPATCH();
     }
     code_fge: {
-        double v2 = AS_NUM(vm_pop(vm));
-        double v1 = AS_NUM(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(v1 >= v2));
+        double v2 = AS_NUM(POP());
+        double v1 = AS_NUM(POP());
+        PUSH(BOOL_VAL(v1 >= v2));
         DISPATCH();
     }
     code_band: {
-        bool b2 = AS_BOOL(vm_pop(vm));
-        bool b1 = AS_BOOL(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(b1 && b2));
+        bool b2 = AS_BOOL(POP());
+        bool b1 = AS_BOOL(POP());
+        PUSH(BOOL_VAL(b1 && b2));
         DISPATCH();
     }
     code_bor: {
-        bool b2 = AS_BOOL(vm_pop(vm));
-        bool b1 = AS_BOOL(vm_pop(vm));
-        vm_push(vm, BOOL_VAL(b1 || b2));
+        bool b2 = AS_BOOL(POP());
+        bool b1 = AS_BOOL(POP());
+        PUSH(BOOL_VAL(b1 || b2));
         DISPATCH();
     }
     code_getsub: {
@@ -772,19 +1707,31 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         // | object |
         // | key     |
         // | getsub |
-        val_t key = vm_pop(vm);
-        val_t obj = vm_pop(vm);
-        int idx = AS_INT32(key);
-
-        if(IS_STRING(obj)) {
-            char* str = AS_STRING(obj);
-            // VM_ASSERT(idx >= 0 && idx < strlen(str), "Array index out of bounds");
-            vm_push(vm, INT32_VAL(str[idx]));
-        } else {
-            obj_array_t* arr = AS_ARRAY(obj);
-            // VM_ASSERT(idx >= 0 && idx < arr->len, "Array index out of bounds");
-            vm_copy(vm, arr->data[idx]);
-        }
+        // Quickened on the first execution
+        QUICKEN(IS_STRING(sp[-2]) ? OP_SGETSUB : OP_AGETSUB);
+        goto *instr->handler;
+    }
+    getsub_any: {
+        // Deoptimized, the instruction sees strings and arrays
+        if(IS_STRING(sp[-2])) goto sgetsub;
+        goto agetsub;
+    }
+    code_agetsub: {
+        GUARD(sp[-2], OBJ_ARRAY, OP_GETSUB, getsub_any);
+    agetsub:;
+        int idx = AS_INT32(POP());
+        obj_array_t* arr = AS_ARRAY(POP());
+        // VM_ASSERT(idx >= 0 && idx < arr->len, "Array index out of bounds");
+        PUSH(arr->data[idx]);
+        DISPATCH();
+    }
+    code_sgetsub: {
+        GUARD(sp[-2], OBJ_STRING, OP_GETSUB, getsub_any);
+    sgetsub:;
+        int idx = AS_INT32(POP());
+        char* str = AS_STRING(POP());
+        // VM_ASSERT(idx >= 0 && idx < strlen(str), "Array index out of bounds");
+        PUSH(INT32_VAL(str[idx]));
         DISPATCH();
     }
     code_setsub: {
@@ -793,165 +1740,136 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         // | object  |
         // | key     |
         // | setsub  |
-        val_t key = vm_pop(vm);
-        val_t obj = vm_pop(vm);
-        val_t val = vm_pop(vm);
-        int idx = AS_INT32(key);
-
-        if(IS_STRING(obj)) {
-            obj = COPY_VAL(obj);
-            char* data = AS_STRING(obj);
-            // VM_ASSERT(idx >= 0 && idx < strlen(data), "Array index out of bounds");
-            data[idx] = (char)AS_INT32(val);
-            vm_register(vm, obj);
-        }
-        else {
-            // Copy the whole array
-            // Upload the new array
-            obj = COPY_VAL(obj);
-
-            // Free the copied object at index
-            obj_array_t* arr = AS_ARRAY(obj);
-            val_free(arr->data[idx]);
+        // Operands stay on the stack, until the object is owned.
+        val_t key = sp[-1];
+        val_t val = sp[-3];
+        obj_t* src = AS_OBJ(sp[-2]);
+        obj_t* obj = vm_unshare(vm, src, 0);
+        vm_setsub(vm, obj, AS_INT32(key), val);
 
-            // Try to replace it
-            // VM_ASSERT(idx >= 0 && idx < arr->len, "Array index out of bounds");
-            arr->data[idx] = val;
-            vm_register(vm, obj);
-        }
+        sp -= 3;
+        PUSH(OBJ_VAL(obj));
+        GC_POLL_COPY(obj, src);
         DISPATCH();
     }
     code_len: {
-        val_t obj = vm_pop(vm);
-
-        if(IS_STRING(obj)) {
-            char* data = AS_STRING(obj);
-            vm_push(vm, INT32_VAL(strlen(data)));
-        } else {
-            obj_array_t* arr = AS_ARRAY(obj);
-            vm_push(vm, INT32_VAL(arr->len));
-        }
+        // Quickened on the first execution
+        QUICKEN(IS_STRING(sp[-1]) ? OP_SLEN : OP_ALEN);
+        goto *instr->handler;
+    }
+    len_any: {
+        if(IS_STRING(sp[-1])) goto slen;
+        goto alen;
+    }
+    code_alen: {
+        GUARD(sp[-1], OBJ_ARRAY, OP_LEN, len_any);
+    alen:;
+        obj_array_t* arr = AS_ARRAY(POP());
+        PUSH(INT32_VAL(arr->len));
+        DISPATCH();
+    }
+    code_slen: {
+        GUARD(sp[-1], OBJ_STRING, OP_LEN, len_any);
+    slen:;
+        char* data = AS_STRING(POP());
+        PUSH(INT32_VAL(strlen(data)));
         DISPATCH();
     }
     code_append: {
-        val_t val = vm_pop(vm);
-        val_t obj = vm_pop(vm);
-
-        if(IS_STRING(obj)) {
-            // Simple string concatenation
-            char* str1 = AS_STRING(obj);
-            char* str2 = AS_STRING(val);
-            size_t len = strlen(str1) + strlen(str2) + 1;
-            char* data = malloc(sizeof(char) * len);
-            data[0] = '\0';
-            strcat(data, str1);
-            strcat(data, str2);
-
-            obj_t* obj_ptr = obj_string_nocopy_new(data);
-            vm_push(vm, OBJ_VAL(obj_ptr));
-            obj_append(vm, obj_ptr);
-        } else {
-            // Allocate a new val_t array
-            // Upload it into a obj_t form
-            // register it / push it to the stack
-            obj_array_t* arr1 = AS_ARRAY(obj);
-            obj_array_t* arr2 = AS_ARRAY(val);
-
-            size_t len = arr1->len + arr2->len;
-            val_t* arr3 = malloc(sizeof(val_t) * len);
-
-            size_t i;
-            for(i = 0; i < arr1->len; i++) {
-                arr3[i] = val_copy(arr1->data[i]);
-            }
-            for(i = 0; i < arr2->len; i++) {
-                arr3[i+arr1->len] = val_copy(arr2->data[i]);
-            }
-
-            obj_t* newObj = obj_array_new(arr3, len);
-            vm_push(vm, OBJ_VAL(newObj));
-            obj_append(vm, newObj);
+        // Quickened on the first execution
+        QUICKEN(IS_STRING(sp[-2]) ? OP_SAPPEND : OP_AAPPEND);
+        goto *instr->handler;
+    }
+    append_any: {
+        if(IS_STRING(sp[-2])) goto sappend;
+        goto aappend;
+    }
+    code_sappend: {
+        GUARD(sp[-2], OBJ_STRING, OP_APPEND, append_any);
+    sappend:;
+        // Simple string concatenation
+        char* str2 = AS_STRING(POP());
+        char* str1 = AS_STRING(POP());
+        size_t len1 = strlen(str1);
+        size_t len2 = strlen(str2);
+        obj_t* obj_ptr = obj_string_buffer_new(len1 + len2);
+        char* data = obj_ptr->data;
+        memcpy(data, str1, len1);
+        memcpy(data + len1, str2, len2 + 1);
+
+        PUSH(OBJ_VAL(obj_ptr));
+        GC_POINT();
+        vm_gc_poll(vm);
+        DISPATCH();
+    }
+    code_aappend: {
+        GUARD(sp[-2], OBJ_ARRAY, OP_APPEND, append_any);
+    aappend:;
+        // Allocate a new val_t array
+        // Upload it into a obj_t form
+        // register it / push it to the stack
+        obj_array_t* arr2 = AS_ARRAY(POP());
+        obj_array_t* arr1 = AS_ARRAY(POP());
+
+        size_t len = arr1->len + arr2->len;
+        obj_t* newObj = obj_array_new(len);
+        val_t* arr3 = ((obj_array_t*)newObj->data)->data;
+
+        size_t i;
+        for(i = 0; i < arr1->len; i++) {
+            arr3[i] = arr1->data[i];
+            RETAIN_VAL(arr3[i]);
         }
+        for(i = 0; i < arr2->len; i++) {
+            arr3[i+arr1->len] = arr2->data[i];
+            RETAIN_VAL(arr3[i+arr1->len]);
+        }
+
+        PUSH(OBJ_VAL(newObj));
+        GC_POINT();
+        vm_gc_poll(vm);
         DISPATCH();
     }
     code_cons: {
         // Construct a new value on top
-        val_t val = vm_pop(vm);
-        val_t obj = vm_pop(vm);
-
-        if(IS_STRING(obj)) {
-            // Allocate len + 2 => one for the char and one for the trailing zero
-            char* str = AS_STRING(obj);
-            size_t len = strlen(str);
-            char c = (char)AS_INT32(val);
-            char* newStr = malloc(sizeof(char) * (len+2));
-            strcpy(newStr, str);
-            newStr[len] = c;
-            newStr[len+1] = '\0';
-
-            obj_t* obj_ptr = obj_string_nocopy_new(newStr);
-            vm_push(vm, OBJ_VAL(obj_ptr));
-            obj_append(vm, obj_ptr);
-        } else {
-            // Copy the whole array
-            obj = COPY_VAL(obj);
-
-            // Get the information
-            obj_array_t* arr = AS_ARRAY(obj);
-            arr->len += 1;
-            size_t allocSz = sizeof(val_t) * arr->len;
+        val_t val = sp[-1];
+        obj_t* src = AS_OBJ(sp[-2]);
+        obj_t* obj = vm_cons(vm, src, val, 0);
 
-            // Reallocate and assign its content
-            arr->data = (arr->len == 1) ? malloc(allocSz) : realloc(arr->data, allocSz);
-            arr->data[arr->len-1] = COPY_VAL(val);
-
-            //vm_register(vm, obj);
-            vm_push(vm, obj);
-            obj_append(vm, AS_OBJ(obj));
-        }
+        sp -= 2;
+        PUSH(OBJ_VAL(obj));
+        GC_POLL_COPY(obj, src);
         DISPATCH();
     }
     code_upval: {
-        int scopes = AS_INT32(instr->v1);
-        int offset = AS_INT32(instr->v2);
-        int fp = vm->fp;
-        int sp = vm->sp;
+        int scopes = instr->a;
+        int offset = instr->b;
 
+        val_t* frame = fp;
         for(int i = 0; i < scopes; i++) {
-            vm->fp = AS_INT32(vm->stack[vm->fp - 2]);
+            frame = stack + AS_INT32(frame[-2]);
         }
-        vm->sp = vm->fp;
-
-        val_t val = vm->stack[vm->fp+offset];
-        vm->sp = sp;
-        vm->fp = fp;
-
-        vm_copy(vm, val);
+        PUSH(frame[offset]);
         DISPATCH();
     }
     code_upstore: {
-        val_t newVal = vm_pop(vm);
-
-        int scopes = AS_INT32(instr->v1);
-        int offset = AS_INT32(instr->v2);
+        val_t newVal = POP();
 
-        int fp = vm->fp;
-        int sp = vm->sp;
+        int scopes = instr->a;
+        int offset = instr->b;
 
+        val_t* frame = fp;
         for(int i = 0; i < scopes; i++) {
-            vm->fp = AS_INT32(vm->stack[vm->fp - 2]);
+            frame = stack + AS_INT32(frame[-2]);
         }
-        vm->sp = vm->fp;
-        vm->stack[vm->fp+offset] = newVal;
-
-        vm->sp = sp;
-        vm->fp = fp;
+        vm_store(&frame[offset], newVal);
         DISPATCH();
     }
     code_class: {
-        obj_t* obj = obj_class_new(AS_INT32(instr->v1));
-        vm_push(vm, OBJ_VAL(obj));
-        obj_append(vm, obj);
+        obj_t* obj = obj_class_new(instr->a);
+        PUSH(OBJ_VAL(obj));
+        GC_POINT();
+        vm_gc_poll(vm);
         DISPATCH();
     }
     code_setfield: {
@@ -959,32 +1877,218 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
         // ---
         // value
         // class
-
-        int index = AS_INT32(instr->v1);
-        val_t val = vm_pop(vm);
-        val_t class = vm_pop(vm);
-
-        obj_class_t* cls = AS_CLASS(class);
+        // The class is either new or owned by the argument 0 slot.
+        int index = instr->a;
+        val_t val = sp[-1];
+        obj_t* src = AS_OBJ(sp[-2]);
+        obj_t* obj = vm_unshare(vm, src, 1);
+
+        obj_class_t* cls = obj->data;
+        val_t old = cls->fields[index];
+        RETAIN_VAL(val);
+        RELEASE_VAL(old);
         cls->fields[index] = val;
+        vm_write_barrier(vm, obj, old, val);
 
-        vm_push(vm, class);
+        sp -= 2;
+        PUSH(OBJ_VAL(obj));
+        GC_POLL_COPY(obj, src);
         DISPATCH();
     }
     code_getfield: {
-        // Copy val to keep class internal value alive
-        int index = AS_INT32(instr->v1);
-        val_t class = vm_pop(vm);
+        // The class keeps its value, it is shared
+        int index = instr->a;
+        val_t class = POP();
 
         obj_class_t* cls = AS_CLASS(class);
-        val_t val = cls->fields[index];
+        PUSH(cls->fields[index]);
+        DISPATCH();
+    }
+    code_msetsub: {
+        // Stack:
+        // | value   |
+        // | key     |
+        // | object  |
+        // | msetsub |
+        // The object is loaded from a mutable variable and stored back afterwards.
+        // If the variable is the only owner, no copy is needed.
+        val_t key = sp[-2];
+        val_t val = sp[-3];
+        obj_t* src = AS_OBJ(sp[-1]);
+        obj_t* obj = vm_unshare(vm, src, 1);
+        vm_setsub(vm, obj, AS_INT32(key), val);
+
+        sp -= 3;
+        PUSH(OBJ_VAL(obj));
+        GC_POLL_COPY(obj, src);
+        DISPATCH();
+    }
+    code_mcons: {
+        // Stack:
+        // | value   |
+        // | object  |
+        // | mcons   |
+        // Same as msetsub, appends in place if the variable is the only owner.
+        val_t val = sp[-2];
+        obj_t* src = AS_OBJ(sp[-1]);
+        obj_t* obj = vm_cons(vm, src, val, 1);
+
+        sp -= 2;
+        PUSH(OBJ_VAL(obj));
+        GC_POLL_COPY(obj, src);
+        DISPATCH();
+    }
+
+    // Superinstructions, the rest of the fused sequence is skipped
+    code_lliadd: {
+        int v1 = AS_INT32(fp[instr->a]);
+        int v2 = AS_INT32(fp[instr->b]);
+        PUSH(INT32_VAL(v1 + v2));
+        ip += 2;
+        DISPATCH();
+    }
+    code_lkiadd: {
+        int v1 = AS_INT32(fp[instr->a]);
+        PUSH(INT32_VAL(v1 + instr->b));
+        ip += 2;
+        DISPATCH();
+    }
+    code_lkisub: {
+        int v1 = AS_INT32(fp[instr->a]);
+        PUSH(INT32_VAL(v1 - instr->b));
+        ip += 2;
+        DISPATCH();
+    }
+    code_linc: {
+        // Integers are not owned, the slot can be written directly
+        val_t* slot = &fp[instr->a];
+        *slot = INT32_VAL(AS_INT32(*slot) + instr->b);
+        ip += 3;
+        DISPATCH();
+    }
+    code_ginc: {
+        val_t* slot = &stack[instr->a];
+        *slot = INT32_VAL(AS_INT32(*slot) + instr->b);
+        ip += 3;
+        DISPATCH();
+    }
+    code_iltjmpf: {
+        int v2 = AS_INT32(POP());
+        int v1 = AS_INT32(POP());
+        ip = (v1 < v2) ? ip + 1 : instr->target;
+        DISPATCH();
+    }
+    code_lkiltjmpf: {
+        int v1 = AS_INT32(fp[instr->a]);
+        ip = (v1 < instr->b) ? ip + 3 : instr->target;
+        DISPATCH();
+    }
+    code_ldfield: {
+        int args = AS_INT32(fp[-3]);
+        obj_class_t* cls = AS_CLASS(fp[-args-4]);
+        PUSH(cls->fields[instr->a]);
+        ip += 1;
+        DISPATCH();
+    }
 
-        // Old, slow version
-        // val = COPY_VAL(val); // <--
-        // vm_register(vm, val);
+    // Register instructions (see regcode.h)
+    // Operands are frame slots, afterwards the stack pointer is set to fp + h.
+    #define REG_BINARY(type, get, v2, result) { \
+        val_t* reg = fp; \
+        type v1 = get(reg[instr->b]); \
+        type y = v2; \
+        reg[instr->a] = result; \
+        sp = fp + instr->h; \
+        DISPATCH(); \
+    }
+    #define REG_INT(result) REG_BINARY(int, AS_INT32, AS_INT32(reg[instr->c]), result)
+    #define REG_INTK(result) REG_BINARY(int, AS_INT32, instr->c, result)
+    #define REG_FLOAT(result) REG_BINARY(double, AS_NUM, AS_NUM(reg[instr->c]), result)
 
-        vm_copy(vm, val);
+    // Compare and jump to c, if the condition is false
+    #define REG_JMPF(v2, cond) { \
+        val_t* reg = fp; \
+        int v1 = AS_INT32(reg[instr->a]); \
+        int y = v2; \
+        if(!(cond)) { \
+            ip = instr->target; \
+        } \
+        sp = fp + instr->h; \
+        DISPATCH(); \
+    }
+    #define REG_INTJ(cond) REG_JMPF(AS_INT32(reg[instr->b]), cond)
+    #define REG_INTKJ(cond) REG_JMPF(instr->b, cond)
+
+    code_rmov: {
+        // Moves into temporaries, these are not owned
+        fp[instr->a] = fp[instr->b];
+        sp = fp + instr->h;
+        DISPATCH();
+    }
+    code_rmovg: {
+        fp[instr->a] = stack[instr->b];
+        sp = fp + instr->h;
+        DISPATCH();
+    }
+    code_rmovk: {
+        fp[instr->a] = consts[instr->b];
+        sp = fp + instr->h;
         DISPATCH();
     }
+    code_rjmpf: {
+        bool result = AS_BOOL(fp[instr->a]);
+        if(!result) {
+            ip = instr->target;
+        }
+        sp = fp + instr->h;
+        DISPATCH();
+    }
+    code_riadd: REG_INT(INT32_VAL(v1 + y))
+    code_risub: REG_INT(INT32_VAL(v1 - y))
+    code_rimul: REG_INT(INT32_VAL(v1 * y))
+    code_ridiv: REG_INT(INT32_VAL(v1 / y))
+    code_rmod: REG_INT(INT32_VAL(v1 % y))
+    code_rieq: REG_INT(BOOL_VAL(v1 == y))
+    code_rine: REG_INT(BOOL_VAL(v1 != y))
+    code_rilt: REG_INT(BOOL_VAL(v1 < y))
+    code_rigt: REG_INT(BOOL_VAL(v1 > y))
+    code_rile: REG_INT(BOOL_VAL(v1 <= y))
+    code_rige: REG_INT(BOOL_VAL(v1 >= y))
+    code_riaddk: REG_INTK(INT32_VAL(v1 + y))
+    code_risubk: REG_INTK(INT32_VAL(v1 - y))
+    code_rieqk: REG_INTK(BOOL_VAL(v1 == y))
+    code_rinek: REG_INTK(BOOL_VAL(v1 != y))
+    code_riltk: REG_INTK(BOOL_VAL(v1 < y))
+    code_rigtk: REG_INTK(BOOL_VAL(v1 > y))
+    code_rilek: REG_INTK(BOOL_VAL(v1 <= y))
+    code_rigek: REG_INTK(BOOL_VAL(v1 >= y))
+    code_rfadd: REG_FLOAT(NUM_VAL(v1 + y))
+    code_rfsub: REG_FLOAT(NUM_VAL(v1 - y))
+    code_rfmul: REG_FLOAT(NUM_VAL(v1 * y))
+    code_rfdiv: REG_FLOAT(NUM_VAL(v1 / y))
+    code_rflt: REG_FLOAT(BOOL_VAL(v1 < y))
+    code_rfgt: REG_FLOAT(BOOL_VAL(v1 > y))
+    code_rfle: REG_FLOAT(BOOL_VAL(v1 <= y))
+    code_rfge: REG_FLOAT(BOOL_VAL(v1 >= y))
+    code_rret: {
+        val_t ret = fp[instr->a];
+
+        LEAVE();
+        PUSH(ret);
+        DISPATCH();
+    }
+    code_rieqj: REG_INTJ(v1 == y)
+    code_rinej: REG_INTJ(v1 != y)
+    code_riltj: REG_INTJ(v1 < y)
+    code_rigtj: REG_INTJ(v1 > y)
+    code_rilej: REG_INTJ(v1 <= y)
+    code_rigej: REG_INTJ(v1 >= y)
+    code_rieqkj: REG_INTKJ(v1 == y)
+    code_rinekj: REG_INTKJ(v1 != y)
+    code_riltkj: REG_INTKJ(v1 < y)
+    code_rigtkj: REG_INTKJ(v1 > y)
+    code_rilekj: REG_INTKJ(v1 <= y)
+    code_rigekj: REG_INTKJ(v1 >= y)
 }
 
 // Clears the VM
@@ -992,31 +2096,63 @@ void vm_exec(vm_t* vm, vector_t* buffer) {
 // => clears all elements by GC.
 void vm_clear(vm_t* vm) {
     vm->sp = 0;
+    vm->lp = 0;
+    vm->depth = 0;
     vm_gc(vm);
+    free(vm->young.objs);
+    vm->young.objs = 0;
+    vm->young.num = 0;
+    vm->young.cap = 0;
+    free(vm->remembered);
+    vm->remembered = 0;
+    vm->capRemembered = 0;
+    free(vm->grey);
+    vm->grey = 0;
+    vm->capGrey = 0;
     vm->argc = 0;
     vm->argv = 0;
 }
 
-void vm_run(vm_t* vm, vector_t* buffer) {
-    vm_run_args(vm, buffer, 0, 0);
+void vm_run(vm_t* vm, bytecode_t* bytecode) {
+    vm_run_args(vm, bytecode, 0, 0);
 }
 
-// Execute a buffer
-void vm_run_args(vm_t* vm, vector_t* buffer, int argc, char** argv) {
+// Execute packed bytecode
+void vm_run_args(vm_t* vm, bytecode_t* bytecode, int argc, char** argv) {
     vm->argc = argc;
     vm->argv = argv;
-    vm->maxObjects = 8;
+    vm_gc_config(vm);
 
 #ifndef NO_IR
     // Print out bytecodes
-    vm_print_code(vm, buffer);
+    vm_print_code(vm, bytecode);
     printf("\nExecution:\n");
 #endif
 
-    // Run
+    // Stack sizes for the overflow checks and the live variables at the calls,
+    // before the code is fused
+    int size = vm_frame_sizes(bytecode);
+    vm->checked = size < 0;
+    vm_stack_maps(bytecode, &vm->maps);
+
+#ifndef NO_FUSE
+    bytecode_fuse(bytecode);
+#endif
+
+    // Run, new objects are registered in the nursery
 #ifndef NO_EXEC
-    vm_exec(vm, buffer);
+    obj_nursery = &vm->young;
+    if(size >= STACK_SIZE) {
+        vm_throw(vm, "Stack overflow");
+    } else {
+        vm_exec(vm, bytecode);
+    }
 #endif
 
     vm_clear(vm);
+    obj_nursery = 0;
+    free(vm->maps.index);
+    free(vm->maps.bits);
+    vm->maps.index = 0;
+    vm->maps.bits = 0;
 }
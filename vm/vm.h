@@ -23,6 +23,56 @@
 #include <lib/native.h>
 
 #define STACK_SIZE 512
+// Objects allocated between two minor collections, the nursery may exceed it until the next poll
+#define NURSERY_SIZE 1024
+// Bytes allocated in the nursery, that trigger a minor collection as well
+#define NURSERY_BYTES (1 << 20)
+
+// Pacing of the full collections by the bytes of the old objects (see vm_gc_config):
+// the first one starts at GC_HEAP_INITIAL bytes, the next ones when the bytes, that survived
+// the last one, have grown by GC_HEAP_GROWTH. The target never exceeds the maximum heap size,
+// if one is set. The values can be changed with the environment variables
+// GOLEM_GC_INITIAL, GOLEM_GC_GROWTH and GOLEM_GC_MAX (sizes take a K, M or G suffix).
+// After a full collection sparse pages of the payloads are compacted, unless GOLEM_GC_COMPACT is 0.
+// GOLEM_GC_THREADS sets the threads of the parallel marking, it marks heaps of any size then.
+#define GC_HEAP_INITIAL (4 << 20)
+#define GC_HEAP_GROWTH 2.0
+// Work of an incremental collection slice (scanned fields, swept objects),
+// also the objects swept by an allocation after a full collection
+#define GC_SLICE 64
+
+// Phase of the incremental collection or the lazy sweep of the old objects (see vm_gc_step)
+typedef enum {
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP
+} gc_phase_t;
+
+// Fields scanned at once, the rest of a large array is scanned after its children
+#define MARK_CHUNK 256
+// Distance of the fields, whose objects are prefetched while scanning
+#define MARK_PREFETCH 8
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p)
+#endif
+
+// Local variables, that are live at the calls (see vm_stack_maps)
+// @index Offset of the map of every instruction in @bits, -1 if all variables are kept
+// @bits Maps of @words words, bit i is set if the variable at fp + i is read after the call
+typedef struct {
+	int* index;
+	uint64_t* bits;
+	int words;
+} vm_stackmap_t;
+
+// Object on a mark stack, its fields from @next on are not scanned yet
+typedef struct {
+	obj_t* obj;
+	size_t next;
+} gc_grey_t;
 
 /**
  * vm_t - VM definition
@@ -31,40 +81,104 @@
  * @pc Program counter
  * @fp Frame pointer
  * @sp Stack pointer
- * @firstVal Current reference for GC
- * @numObject Counted objects by GC
- * @maxObjects Count of objects when GC is triggered
+ * @lp End of the local variables of the current frame
+ * @frames Saved local pointers of the calling frames
+ * @bases Frame pointers of the called frames
+ * @depth Call depth
+ * @maps Live variables at the calls, dead ones are no roots of the collector
+ * @young Objects allocated since the last minor collection (nursery, see obj_new),
+ *   old objects are found by the bitmaps of the page heap (see heap.h)
+ * @youngBytes Bytes of the first @youngCounted young objects (see vm_gc_poll)
+ * @numObjects Count of the old objects, @heapBytes their bytes (see obj_size)
+ * @heapTarget Bytes of the old objects, that trigger a full collection
+ * @heapInitial, @heapGrowth, @heapMax Pacing of the full collections (see GC_HEAP_INITIAL), 0 is no maximum
+ * @markedBytes Bytes of the old objects, that were marked by the running full collection
+ * @remembered Old objects referencing young objects (remembered set, see vm_write_barrier)
+ * @gcSlice Work of an incremental slice, 0 collects the old objects at once
+ * @gcPhase Phase of the incremental collection or lazy sweep, @grey the worklist of the marking
+ * @gcThreads Threads marking the heap in a full collection (see parmark.h), 0 or 1 marks serially
+ * @gcParallelMin Objects of the heap, that are marked in parallel (see vm_gc_config)
+ * @gcCompact Compaction of the payloads after a full collection (see vm_gc_config)
  * @errjmp Jump position when failure occurs.
  * @argc Argument count
  * @argc Arguments
+ * @jit Native code of hot functions, null if the JIT is disabled (see jit.h)
+ * @checked The stack heights of the code are unknown: the stack is checked before every instruction,
+ *          the JIT is not used
  */
+typedef struct jit_t jit_t;
+
 typedef struct {
 	// Stack
 	val_t stack[STACK_SIZE];
 	int pc;
 	int fp;
 	int sp;
+	int lp;
+	int frames[STACK_SIZE];
+	int bases[STACK_SIZE];
+	int depth;
 
 	// Gargabe collection
-	obj_t* firstVal;
+	vm_stackmap_t maps;
+	obj_nursery_t young;
+	size_t youngBytes;
+	int youngCounted;
 	int numObjects;
-	int maxObjects;
+	size_t heapBytes;
+	size_t heapTarget;
+	size_t heapInitial;
+	double heapGrowth;
+	size_t heapMax;
+	size_t markedBytes;
+	obj_t** remembered;
+	int numRemembered;
+	int capRemembered;
+	int gcSlice;
+	gc_phase_t gcPhase;
+	gc_grey_t* grey;
+	int numGrey;
+	int capGrey;
+	int gcThreads;
+	int gcParallelMin;
+	bool gcCompact;
 
 	int errjmp;
 	int argc;
 	char** argv;
+	jit_t* jit;
+	bool checked;
 } vm_t;
 
 // Internal function
 typedef void (*gvm_c_function)(vm_t*);
 
 // Methods
-void vm_run(vm_t* vm, vector_t* buffer);
-void vm_run_args(vm_t* vm, vector_t* buffer, int argc, char** argv);
+void vm_run(vm_t* vm, bytecode_t* bytecode);
+void vm_run_args(vm_t* vm, bytecode_t* bytecode, int argc, char** argv);
 
 void vm_register(vm_t* vm, val_t val);
+void vm_gc_poll(vm_t* vm);
+void vm_gc_config(vm_t* vm);
 void vm_push(vm_t* vm, val_t val);
 val_t vm_pop(vm_t* vm);
 void vm_gc(vm_t* vm);
+void vm_gc_minor(vm_t* vm);
+void vm_gc_step(vm_t* vm, int budget);
+void vm_write_barrier(vm_t* vm, obj_t* obj, val_t old, val_t val);
+int vm_syscall_args(int index);
+void vm_syscall(vm_t* vm, int index);
+void vm_throw(vm_t* vm, const char* format, ...);
+void vm_clear(vm_t* vm);
+void vm_store(val_t* slot, val_t val);
+obj_t* vm_unshare(vm_t* vm, obj_t* obj, int owners);
+void vm_setsub(vm_t* vm, obj_t* obj, int idx, val_t val);
+obj_t* vm_cons(vm_t* vm, obj_t* obj, val_t val, int owners);
+int vm_stack_effect(code_t* code);
+int vm_stack_after(code_t* code, int height);
+bool vm_stack_heights(bytecode_t* bytecode, int* height);
+int vm_frame_size(bytecode_t* bytecode, int* height, int* owner, int entry);
+int vm_frame_sizes(bytecode_t* bytecode);
+bool vm_stack_maps(bytecode_t* bytecode, vm_stackmap_t* maps);
 
 #endif